@@ -0,0 +1,86 @@
+#!/bin/sh
+# Replays the standard key traces against a headless screen and prints the
+# latency report for each. Usage: bench/run.sh path/to/micrn
+#
+# A trace is the raw input a terminal sends, so one can also be recorded
+# from a real session, e.g. with script --log-in trace.keys.
+
+MICRN=${1:-./micrn}
+SRC=$(dirname "$0")/../main.c
+DIR=${TMPDIR:-/tmp}/micrn-bench.$$
+mkdir -p "$DIR"
+trap 'rm -rf "$DIR"' EXIT
+
+ESC=$(printf '\033')
+CTRL_N=$(printf '\016')
+CTRL_P=$(printf '\020')
+CTRL_S=$(printf '\023')
+CTRL_U=$(printf '\025')
+
+# typing: prose with corrections, into an empty buffer
+i=0
+while [ $i -lt 100 ]; do
+    printf 'The quick brown fox jumps over the lazy dog, line %d.\n' $i
+    printf 'Teh\177\177he end.\n'
+    i=$((i + 1))
+done > "$DIR/typing.keys"
+
+# paste: a 5000-line bracketed paste, then undo and redo it
+{
+    printf '\033[200~'
+    awk '{ print } NR == 5000 { exit }' "$SRC"
+    printf '\033[201~%s%su' "$CTRL_U" "$ESC"
+} > "$DIR/paste.keys"
+
+# scroll: down through a highlighted C file and back up
+{
+    i=0
+    while [ $i -lt 3000 ]; do printf '%s' "$CTRL_N"; i=$((i + 1)); done
+    i=0
+    while [ $i -lt 3000 ]; do printf '%s' "$CTRL_P"; i=$((i + 1)); done
+} > "$DIR/scroll.keys"
+
+# search: incremental literal and regexp searches, stepping through matches
+{
+    printf '%sbuffer_line' "$CTRL_S"
+    i=0
+    while [ $i -lt 100 ]; do printf '%s' "$CTRL_S"; i=$((i + 1)); done
+    printf '\n%ss[a-z]+_[0-9a-z]+\\(' "$ESC"
+    i=0
+    while [ $i -lt 100 ]; do printf '%s' "$CTRL_S"; i=$((i + 1)); done
+    printf '\n'
+} > "$DIR/search.keys"
+
+# replace: a replace-all that opens a comment on many lines in one frame,
+# so the lexer states below each of them must be resynced; then undo, redo
+printf '%srreturn\n/*\n%s%su' "$ESC" "$CTRL_U" "$ESC" > "$DIR/replace.keys"
+
+# matches: regexp searches on a line with 50000 matches, which has to be
+# scanned once rather than once per match for painting and counting, and
+# a greedy a.*b whose match on the second line ends well before the edge
+# of the screen while the pattern stays live past it
+awk 'BEGIN {
+    for (i = 0; i < 50000; i++) printf "ab"
+    printf "\naxxb"
+    for (i = 0; i < 200; i++) printf "y"
+    print ""
+}' > "$DIR/matches.txt"
+{
+    printf '%ssa' "$ESC"
+    i=0
+    while [ $i -lt 100 ]; do printf '%s' "$CTRL_S"; i=$((i + 1)); done
+    printf '\n%ss[ab]b\n%ssa.*b\n' "$ESC" "$ESC"
+} > "$DIR/matches.keys"
+
+# bigfile: open about 100 MB, jump near the end and edit there
+awk 'BEGIN { for (i = 0; i < 2000000; i++) printf "%08d the quick brown fox jumps over the lazy dog\n", i }' > "$DIR/big.txt"
+printf '%sg1999000\nedit%s%s' "$ESC" "$CTRL_N" "$CTRL_P" > "$DIR/bigfile.keys"
+
+status=0
+for trace in typing:"" paste:"" scroll:"$SRC" search:"$SRC" replace:"$SRC" matches:"$DIR/matches.txt" bigfile:"$DIR/big.txt"; do
+    name=${trace%%:*}
+    file=${trace#*:}
+    echo
+    "$MICRN" --bench "$DIR/$name.keys" $file || status=1
+done
+exit $status
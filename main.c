@@ -3,8 +3,27 @@
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include <ncurses.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define STRING_CHAR char
 #define STRCHR strchr
@@ -20,13 +39,51 @@
 #define ISALNUM isalnum
 #define NEWLINE "\n"
 
-#define MAX_LINES 10000
 #define MAX_LINE_LEN 1024
 #define MAX_FILENAME_LEN 256
-#define MAX_KILL_RING 1
+#define KILL_RING_SIZE 32
+#define UNDO_RUN_MAX 256
+#define MIN_LINE_CAPACITY 64
+#define POOL_MIN_SHIFT 4
+#define POOL_NUM_CLASSES 12
+#define POOL_SLAB_SIZE (64 * 1024)
+#define LARGE_FILE_SIZE (8 * 1024 * 1024)
+#define PACK_BLOCK_SIZE (64 * 1024)
+#define SAVE_IOV_MAX 512
+#define SAVE_BATCH_BYTES (4 * 1024 * 1024)
+#define JOURNAL_MAGIC "MJNL"
+#define JOURNAL_HEADER_SIZE 21
+#define JOURNAL_BASE_FILE 'F'
+#define JOURNAL_BASE_CHECKPOINT 'C'
+#define JOURNAL_COMMIT_MS 200
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024)
+#define PACK_IDLE_SWITCHES 4
+#define FOLLOW_POLL_MS 250
+#define FOLLOW_READ_SIZE (64 * 1024)
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define INDEX_BATCH_LINES 1024
+#define INDEX_CHUNK_SIZE (16 * 1024 * 1024)
+#define MAX_WORKERS 16
+#define RE_MAX_REPEAT 1000
+#define RE_MAX_STATES 20000
+#define RE_MAX_DFA_STATES 2048
+#define MATCH_CACHE_LINES 256
+#define LEX_MARK_LINES 256
+#define LEX_MARK_INTERVAL 1024
+#define SEARCH_COUNT_BYTES (1024 * 1024)
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define ALT_KEY(k) (k)
 #define CTRL_X_TIMEOUT 1
+#define INPUT_BATCH_MAX 4096
+#define PASTE_TIMEOUT 100
+#define PASTE_GAP_TIMEOUT 10000
+#define BENCH_TERM "xterm"
+#define BENCH_LINES 40
+#define BENCH_COLS 120
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
 
 // Language types
 typedef enum {
@@ -34,7 +91,13 @@ typedef enum {
     LANG_HTML,
     LANG_CSS,
     LANG_C,
-    LANG_PYTHON
+    LANG_PYTHON,
+    LANG_GO,
+    LANG_RUST,
+    LANG_SHELL,
+    LANG_YAML,
+    LANG_JSON,
+    LANG_COUNT
 } Language;
 
 // Token types
@@ -47,56 +110,455 @@ typedef enum {
     TOKEN_PREPROC
 } TokenType;
 
+// Lexer state carried from the end of one line to the start of the next.
+typedef enum {
+    LEX_NORMAL,
+    LEX_COMMENT,
+    LEX_STRING_DQ,
+    LEX_STRING_SQ,
+    LEX_TRIPLE_DQ,
+    LEX_TRIPLE_SQ,
+    LEX_PREPROC,
+    LEX_UNKNOWN = 0xff
+} LexState;
+
+// A run of characters on one line that share a token type.
+typedef struct {
+    int start, len;
+    TokenType type;
+} Span;
+
+typedef struct {
+    Span *spans;
+    int count, capacity;
+} SpanList;
+
+// A single line of text. lex_state caches the lexer state at the start of
+// the line, or LEX_UNKNOWN if it has not been computed yet. cap is the size
+// of the allocation and grows in powers of two, so typing at the end of a
+// line is amortized O(1). A cap of 0 means the text is borrowed from the
+// file mapping: it is read-only and not NUL-terminated, so callers must
+// always use len rather than STRLEN. A negative cap means the text is packed
+// into compressed block -cap - 1, as line number len of it; buffer_line
+// unpacks it before anyone else sees it. While a save is writing the text
+// out, cap is 0 so that the first change copies it, and the real cap is kept
+// in held_cap.
+typedef struct {
+    char *text;
+    int len;
+    int cap;
+    unsigned char lex_state;
+    int held_cap;
+} Line;
+
+// Size-class allocator for line text. Blocks of 16 bytes up to 32 KB are
+// carved out of 64 KB slabs and recycled through per-class free lists;
+// anything larger goes straight to malloc.
+typedef struct PoolSlab {
+    struct PoolSlab *next;
+} PoolSlab;
+
+typedef struct {
+    void *free_lists[POOL_NUM_CLASSES];
+    PoolSlab *slabs;
+    char *slab_ptr;
+    size_t slab_left;
+    size_t bytes;        // held in slabs and large blocks
+    Line *held;          // blocks released while a save still reads them
+    int held_count, held_capacity;
+} LinePool;
+
+// A growable run of lines, used to collect lines while splitting text.
+typedef struct {
+    Line *lines;
+    int count, capacity;
+} LineList;
+
+// Background line index for a mapped file. The mapping is cut into
+// INDEX_CHUNK_SIZE chunks that are split into lines on the worker pool.
+struct IndexJob;
+
+typedef struct {
+    struct IndexJob *job;
+    size_t start, end;
+    LineList lines;
+} IndexChunk;
+
+typedef struct IndexJob {
+    const char *map;
+    size_t size;
+    IndexChunk *chunks;
+    int num_chunks;
+    int remaining;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} IndexJob;
+
+// A save running on a worker thread. It writes from its own copy of the
+// line list, and the texts it points at are held (see Line) until it is
+// finished, so the buffer can be edited in the meantime.
+typedef struct {
+    char *path;          // the file to replace, with symlinks resolved
+    mode_t mode;
+    Line *lines;
+    int count;
+    const char *map;     // lines inside the mapping run on to their newline
+    size_t map_size;
+    size_t total;
+    unsigned int version;        // of the buffer when the snapshot was taken
+    long start_ns, end_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    size_t written;
+    bool done;
+    int error;           // errno of the step that failed, or 0
+    struct stat st;      // the file as written
+    bool checkpoint;     // a copy for the journal, not a save of the file
+    size_t journal_keep; // journal length when the snapshot was taken
+} SaveJob;
+
+// An append-only log of the edits to a buffer since its file was last
+// written, for recovery after a crash. It starts with a header naming its
+// base, the file or checkpoint the edits apply to, followed by one record
+// per edit: a type byte, varints for y, x and the length, and the text.
+// Records are queued in memory and written by a single thread every
+// JOURNAL_COMMIT_MS, so an edit never waits for the disk.
+typedef struct Journal {
+    char *path;
+    char *base_path;     // where checkpoints of the text are written
+    size_t length;       // bytes appended so far; main thread only
+    size_t checkpoint_at;        // length at which to write a checkpoint
+    // Shared with the writer, under journals.lock.
+    char *pending;
+    size_t pending_len, pending_cap;
+    bool rotate;         // start over with header, keeping bytes from keep on
+    char header[JOURNAL_HEADER_SIZE];
+    size_t keep;
+    bool closing;        // delete the files and free the journal
+    bool existing;       // recovered, so appended to rather than replaced
+    // The writer's own.
+    int fd;
+    struct Journal *next;
+} Journal;
+
+// Immutable text shared by reference between the kill ring and the undo
+// logs, and freed when the last reference is dropped. It is split into
+// lines when it is made, so pasting it needs no scan for line breaks.
+typedef struct {
+    int refs;
+    int len;
+    int line_count;
+    int *line_ends;      // offset of the end of each line; the last is len
+    char text[];
+} TextChunk;
+
+// Undo history. Every edit is recorded as an insertion or a deletion of
+// text, which may span lines, at a position. The text lives in an arena that
+// only grows at the end, so a run of typing costs a byte per keystroke plus
+// one record for the run. Large text, such as a kill or a yank, is
+// referenced through a shared chunk instead of being copied. Records below
+// pos are applied; the ones from pos on have been undone and can be redone.
+// A chained record is undone and redone together with the one before it.
+typedef enum {
+    UNDO_INSERT,
+    UNDO_DELETE
+} UndoType;
+
+typedef struct {
+    unsigned char type;
+    bool chained;
+    int y, x;
+    int len;
+    size_t text;         // offset of the text in the arena
+    TextChunk *chunk;    // the text, if it is not in the arena
+} UndoRecord;
+
+typedef struct {
+    UndoRecord *records;
+    int count, pos, capacity;
+    char *text;
+    size_t text_len, text_cap;
+    bool sealed;         // the last record is not a run that may grow
+} UndoLog;
+
+// Lines of an idle buffer packed together by buffer_pack. The lines of a
+// block are always adjacent, and it is freed once none of them are left.
+typedef struct {
+    char *data;          // compressed text, or NULL for a free slot
+    int size, raw_size;
+    int live;            // lines still packed in it
+} PackBlock;
+
+// Text storage: a gap buffer of lines. Edits near the gap are O(1), moving
+// the gap costs the distance moved, and there is no limit on the line count.
+typedef struct {
+    Line *lines;
+    int gap_start, gap_end;
+    int capacity;
+    LinePool pool;
+    const char *map;
+    size_t map_size;
+    size_t map_scanned;
+    IndexJob *index_job;
+    SaveJob *save;
+    bool save_pending;   // a save asked for during a checkpoint
+    Journal *journal;
+    int damage_start, damage_end;
+    // Lines below lex_valid have a known lex_state, but the end states of
+    // lines lex_dirty_lo through lex_dirty_hi may have changed, so the
+    // states after them may be stale until highlight_sync runs.
+    int lex_valid, lex_dirty_lo, lex_dirty_hi;
+    unsigned int version;        // bumped by every change to the text
+    UndoLog undo;
+    PackBlock *packs;
+    int pack_count, pack_capacity;
+    size_t packed_bytes;
+    // The file behind the buffer and the view to restore when it is shown
+    // again. An unloaded buffer has not been read yet, or was dropped to
+    // stay within the memory budget, and is read when it is next shown.
+    char *filename;
+    bool loaded;
+    bool compact;        // packed while in the background
+    unsigned int saved_version;  // version when last read or written
+    time_t disk_mtime;
+    off_t disk_size;
+    ino_t disk_ino;
+    // Follow mode: the file is watched and what is appended to it is read
+    // in as it arrives.
+    bool following;
+    bool follow_partial;         // the file does not end with a newline
+    bool follow_changed;         // the file may have changed since read
+    int follow_watch;            // inotify watch, or -1 to poll with stat
+    unsigned long last_shown;
+    Language language;
+    int cursor_x, cursor_y, top_line, left_col;
+    int mark_x, mark_y;
+    bool mark_active;
+} TextBuffer;
+
+// Regular expressions. A pattern is parsed into a tree of ReNodes, which is
+// compiled twice into Thompson NFAs: once forward and once with every
+// concatenation reversed. Each NFA is run through a lazily built DFA, so
+// matching is linear in the length of the line however the pattern is
+// written.
+typedef enum {
+    RE_EMPTY,
+    RE_SET,
+    RE_BOL,
+    RE_EOL,
+    RE_CAT,
+    RE_ALT,
+    RE_REPEAT
+} ReNodeType;
+
+typedef struct {
+    unsigned char type;
+    int left, right;     // children; set index for RE_SET
+    int min, max;        // RE_REPEAT bounds, max -1 for unbounded
+} ReNode;
+
+typedef enum {
+    NFA_SET,
+    NFA_SPLIT,
+    NFA_BOL,
+    NFA_EOL,
+    NFA_MATCH
+} NfaOp;
+
+typedef struct {
+    unsigned char op;
+    int out, out1;
+    int set;
+} NfaState;
+
+// A DFA state is the set of NFA states it stands for, closed over splits.
+// next[c] is the state reached on byte c, or -1 if not built yet. accept
+// means a match ends here; accept_edge means one ends here if the scan is at
+// the edge of the line it is moving toward. In an unanchored DFA the
+// restarted pattern is not part of the set, so after the first step accept
+// only counts matches of at least one byte.
+typedef struct {
+    int *nfa;
+    int count;
+    bool accept, accept_edge;
+    int next[256];
+} DfaState;
+
+typedef struct {
+    NfaState *states;
+    int count, capacity;
+    int start;
+    NfaOp edge;          // assertion that holds where a scan runs out of line
+    bool unanchored;     // restart the pattern at every position
+    int *restart;        // the start state's closure, which every step also reads from
+    int restart_count;
+    const unsigned char (*sets)[32];
+    DfaState *dfa;
+    int dfa_count, dfa_capacity;
+    int *table;          // open-addressed hash of NFA sets to DFA states
+    int table_size;
+    int starts[4];       // start state for each combination of BOL and EOL
+    int *mark, *stack, *work;    // scratch space for building closures
+    int generation;
+    unsigned int flushes;        // bumped by dfa_flush, which renumbers the states
+} Dfa;
+
+typedef struct {
+    ReNode *nodes;
+    int node_count, node_capacity;
+    unsigned char (*sets)[32];
+    int set_count, set_capacity;
+    int root;
+    Dfa forward, reverse;
+    unsigned char *starts;   // where matches begin on the line regex_scan ran over
+    int starts_capacity;
+    unsigned int scans;      // bumped by regex_scan
+    // For each forward DFA state, whether a match goes on past column
+    // ahead_at of the line scan ahead_scan: 1 if so, -1 if not, 0 unknown.
+    signed char *ahead;
+    unsigned int ahead_scan, ahead_flushes;
+    int ahead_at;
+    const char *error;
+} Regex;
+
+// A token boundary in a line and the lexer state there, where tokenizing
+// can resume. Long lines keep one every LEX_MARK_INTERVAL bytes or so, so
+// that painting a line scrolled far to the right skips its prefix.
+typedef struct {
+    int offset;
+    unsigned char state;
+} LexMark;
+
+typedef struct {
+    TextBuffer *buf;     // NULL when the entry is unused
+    int y;
+    unsigned char state; // the line's start state when the marks were made
+    LexMark *marks;
+    int count, capacity;
+} LexMarks;
+
+// HDR-style histogram: values below HIST_SUB_BUCKETS are counted exactly,
+// and above that every power of two is split into HIST_SUB_BUCKETS buckets,
+// so a recorded value is never off by more than 1/16.
+typedef struct {
+    long counts[HIST_BUCKETS];
+    long total, sum, max;
+} Histogram;
+
+typedef enum {
+    STAT_COMMAND,        // handle_input, per key
+    STAT_HIGHLIGHT,      // lexing and painting lines, per frame
+    STAT_DRAW,           // the rest of draw and refresh, per frame
+    STAT_FRAME,          // the keys handled since the last frame plus drawing it
+    STAT_ALLOCS,         // allocations made over a frame
+    STAT_COUNT
+} StatKind;
+
+// Latency instrumentation, on while the overlay is shown or when --stats
+// asks for a dump on exit. Times are in nanoseconds.
+typedef struct {
+    bool enabled, overlay;
+    const char *dump_path;
+    Histogram hist[STAT_COUNT];
+    long last[STAT_COUNT];
+    int frame_keys;
+    long frame_ns, frame_allocs, highlight_ns;
+    char overlay_text[160];
+} Stats;
+
+// The search matches on one line, cached while they are on screen. An entry
+// is current only while its stamp and version equal the editor's
+// search_stamp and the buffer's version, and it holds only the matches that
+// start before limit, the right edge of the screen when it was made.
+typedef struct {
+    int y, limit;
+    unsigned int stamp, version;
+    Span *matches;
+    int count, capacity;
+} MatchLine;
+
 typedef struct {
-    char **lines;
-    int num_lines;
+    TextBuffer *buf;
     int cursor_x, cursor_y;
     int top_line;
-    char *filename;
+    int left_col;        // first text column shown, following the cursor
+    int gutter;          // screen columns the line numbers take, set by draw
     int max_y, max_x;
     char message[256];
-    struct {
-        char *action;
-        int x, y;
-        char data;
-        char *bulk_data;
-        int line_count;
-    } *undo_stack;
-    int undo_count, undo_size;
-    char *kill_ring[MAX_KILL_RING];
+    TextChunk **kill_ring;
+    int kill_ring_size;          // set with --kill-ring
+    int kill_head, kill_count;
+    // Where the last kill and yank left off, to tell whether the next kill
+    // continues it and whether Alt+Y may replace the yanked text.
+    TextBuffer *kill_buf, *yank_buf;
+    unsigned int kill_version, yank_version;
+    int kill_y, kill_x;
+    int yank_y, yank_x, yank_end_y, yank_end_x, yank_index;
     int mark_x, mark_y;
     bool mark_active;
     char search_query[256];
     bool searching;
+    bool search_backward;
+    int search_len;
+    bool search_regex;
+    bool search_failed[256];
+    Regex regex;
+    int search_match_x[256], search_match_y[256];
+    bool search_wrapped;
+    unsigned int search_stamp;   // bumped whenever the set of matches changes
+    MatchLine match_cache[MATCH_CACHE_LINES];
+    // Background count of all matches. Lines below count_y have been
+    // scanned; count_before of the matches found lie before the current one.
+    int count_y, count_total, count_before;
+    bool count_done;
+    TextBuffer **buffers;
+    int num_buffers, buffers_capacity;
     int current_buffer;
-    char **buffers[2];
-    int num_lines_buf[2];
-    char *filenames[2];
+    unsigned long buffer_clock;  // ticks once per buffer switch
+    size_t memory_budget;        // for loaded buffers; 0 for no limit
+    int pack_idle;               // switches before a hidden buffer is packed
+    int saving;                  // saves still running
+    int inotify_fd;              // watches followed files, or -1
+    bool quit;                   // set by Ctrl+X Ctrl+C
     Language language;
-    bool in_multiline_comment;
+    SpanList spans;
+    LexMarks lex_marks[LEX_MARK_LINES];
+    // Screen state from the last draw, used to repaint only what changed.
+    bool *dirty_rows;
+    bool full_redraw;
+    int drawn_top_line, drawn_left_col;
+    char drawn_message[256];
+    Stats stats;
 } Editor;
 
 typedef void (*CommandFunc)(Editor *);
 
+MatchLine *search_matches(Editor *e, int y);
+
 // Global commands array
 CommandFunc commands[512] = {0};
 
 // Function prototypes
 void init_editor(Editor *e);
 void cleanup_editor(Editor *e);
+void stats_dump(Editor *e);
 void draw(Editor *e);
 void handle_input(Editor *e, int ch);
-void load_file(Editor *e, const char *filename);
+void poll_background(Editor *e);
+void load_file(Editor *e);
 void save_file(Editor *e);
-void add_undo(Editor *e, const char *action, int x, int y, char data, char *bulk_data, int line_count);
+void save_start(Editor *e, TextBuffer *b, const char *path, bool checkpoint);
+void save_finish(Editor *e, TextBuffer *b);
+void buffer_unpack(TextBuffer *b, int y);
+void undo_record(TextBuffer *b, UndoType type, int y, int x, const char *text, int len, bool chained);
 void undo(Editor *e);
-void insert_char(Editor *e, char c, bool redraw);
+void redo(Editor *e);
+void insert_char(Editor *e, char c);
 void delete_char(Editor *e);
 void delete_char_right(Editor *e);
 void delete_word_left(Editor *e);
 void delete_word_right(Editor *e);
-void insert_newline(Editor *e, bool redraw);
-void insert_lines(Editor *e, char **new_lines, int line_count, bool redraw);
+void insert_newline(Editor *e);
 void move_cursor_up(Editor *e);
 void move_cursor_down(Editor *e);
 void move_cursor_left(Editor *e);
@@ -109,13 +571,20 @@ void move_cursor_beginning_of_line(Editor *e);
 void move_cursor_end_of_line(Editor *e);
 void kill_line(Editor *e);
 void yank(Editor *e);
+void yank_pop(Editor *e);
 void set_mark(Editor *e);
 void delete_region(Editor *e);
 void start_search(Editor *e);
+void start_reverse_search(Editor *e);
+void start_regex_search(Editor *e);
 void update_search(Editor *e, int c);
 void switch_buffer(Editor *e);
 void detect_language(Editor *e);
-void show_info(Editor *e); 
+void show_info(Editor *e);
+void goto_line(Editor *e);
+void replace_all(Editor *e);
+void query_replace(Editor *e);
+void resize_screen(Editor *e);
 
 // Syntax highlighting keywords
 const char *html_keywords[] = {
@@ -145,12 +614,222 @@ const char *python_keywords[] = {
     "raise", "return", "True", "try", "while", "with", "yield", NULL
 };
 
+const char *go_keywords[] = {
+    "break", "case", "chan", "const", "continue", "default", "defer", "else",
+    "fallthrough", "for", "func", "go", "goto", "if", "import", "interface",
+    "map", "package", "range", "return", "select", "struct", "switch", "type",
+    "var", "true", "false", "nil", NULL
+};
+
+const char *rust_keywords[] = {
+    "as", "async", "await", "break", "const", "continue", "crate", "dyn",
+    "else", "enum", "extern", "false", "fn", "for", "if", "impl", "in", "let",
+    "loop", "match", "mod", "move", "mut", "pub", "ref", "return", "self",
+    "Self", "static", "struct", "super", "trait", "true", "type", "unsafe",
+    "use", "where", "while", NULL
+};
+
+const char *shell_keywords[] = {
+    "if", "then", "else", "elif", "fi", "case", "esac", "for", "while",
+    "until", "do", "done", "in", "function", "select", "return", "local",
+    "export", "readonly", "break", "continue", NULL
+};
+
+const char *yaml_keywords[] = {
+    "true", "false", "null", "yes", "no", "on", "off", "True", "False",
+    "Null", NULL
+};
+
+const char *json_keywords[] = {
+    "true", "false", "null", NULL
+};
+
+// Describes how to highlight one language. Everything the lexer knows
+// about a language lives here; adding a language means adding an entry to
+// the languages table, not touching tokenize_line.
+typedef struct {
+    const char *name;
+    const char *extensions[8];
+    const char **keywords;
+    const char *line_comment;
+    const char *block_comment[2];
+    const char *quotes;          // characters that open a single-line string
+    const char *ident_chars;     // characters besides [A-Za-z0-9_] allowed in words
+    bool triple_quotes;          // tripled quotes open strings that span lines
+    bool preprocessor;           // # in column 0 starts a directive
+    bool markup_tags;            // <tag ...> is highlighted as a keyword
+} LanguageDef;
+
+const LanguageDef languages[LANG_COUNT] = {
+    [LANG_NONE] = { .name = "Text" },
+    [LANG_HTML] = {
+        .name = "HTML", .extensions = { ".html", ".htm" }, .keywords = html_keywords,
+        .block_comment = { "<!--", "-->" }, .quotes = "\"'", .markup_tags = true
+    },
+    [LANG_CSS] = {
+        .name = "CSS", .extensions = { ".css" }, .keywords = css_keywords,
+        .block_comment = { "/*", "*/" }, .quotes = "\"'", .ident_chars = "-"
+    },
+    [LANG_C] = {
+        .name = "C", .extensions = { ".c", ".h", ".cpp", ".hpp", ".cc" }, .keywords = c_keywords,
+        .line_comment = "//", .block_comment = { "/*", "*/" }, .quotes = "\"'", .preprocessor = true
+    },
+    [LANG_PYTHON] = {
+        .name = "Python", .extensions = { ".py" }, .keywords = python_keywords,
+        .line_comment = "#", .quotes = "\"'", .triple_quotes = true
+    },
+    [LANG_GO] = {
+        .name = "Go", .extensions = { ".go" }, .keywords = go_keywords,
+        .line_comment = "//", .block_comment = { "/*", "*/" }, .quotes = "\"'`"
+    },
+    [LANG_RUST] = {
+        .name = "Rust", .extensions = { ".rs" }, .keywords = rust_keywords,
+        .line_comment = "//", .block_comment = { "/*", "*/" }, .quotes = "\""
+    },
+    [LANG_SHELL] = {
+        .name = "Shell", .extensions = { ".sh", ".bash", ".zsh", ".bashrc", ".profile" },
+        .keywords = shell_keywords, .line_comment = "#", .quotes = "\"'"
+    },
+    [LANG_YAML] = {
+        .name = "YAML", .extensions = { ".yaml", ".yml" }, .keywords = yaml_keywords,
+        .line_comment = "#", .quotes = "\"'"
+    },
+    [LANG_JSON] = {
+        .name = "JSON", .extensions = { ".json" }, .keywords = json_keywords, .quotes = "\""
+    }
+};
+
+// Word sets are compiled once at startup into perfect hash tables: a seed
+// is searched for that gives every word a slot of its own, so a lookup is
+// one hash of the word in place and at most one memcmp. Keyword sets and
+// the extension map share this representation.
+typedef struct {
+    const char **slots;
+    unsigned char *lens;
+    unsigned char *values;
+    unsigned int seed;
+    int bits;
+} WordTable;
+
+unsigned int word_slot(const WordTable *t, const char *word, int len) {
+    unsigned int h = 2166136261u ^ t->seed;
+    for (int i = 0; i < len; i++) h = (h ^ (unsigned char)word[i]) * 16777619u;
+    return (h ^ (h >> 16)) & ((1u << t->bits) - 1);
+}
+
+void word_table_build(WordTable *t, const char **words, const unsigned char *values, int n) {
+    if (n == 0) return;
+    for (t->bits = 1; (1 << t->bits) < n * 2; t->bits++);
+    while (1) {
+        int size = 1 << t->bits;
+        t->slots = realloc(t->slots, size * sizeof(char *));
+        t->lens = realloc(t->lens, size);
+        t->values = realloc(t->values, size);
+        for (t->seed = 0; t->seed < 4096; t->seed++) {
+            memset(t->slots, 0, size * sizeof(char *));
+            int k = 0;
+            for (; k < n; k++) {
+                int len = STRLEN(words[k]);
+                unsigned int slot = word_slot(t, words[k], len);
+                if (t->slots[slot]) break;
+                t->slots[slot] = words[k];
+                t->lens[slot] = len;
+                t->values[slot] = values ? values[k] : 0;
+            }
+            if (k == n) return;
+        }
+        t->bits++;
+    }
+}
+
+// Returns the slot holding word, or -1 if it is not in the table.
+int word_table_find(const WordTable *t, const char *word, int len) {
+    if (!t->slots) return -1;
+    unsigned int slot = word_slot(t, word, len);
+    if (t->slots[slot] && t->lens[slot] == len && memcmp(t->slots[slot], word, len) == 0) return slot;
+    return -1;
+}
+
+// Character classes the lexer dispatches on. CC_DELIM marks bytes that may
+// open a comment, a directive or a tag; the language decides which.
+enum {
+    CC_OTHER,
+    CC_SPACE,
+    CC_IDENT,
+    CC_DIGIT,
+    CC_QUOTE,
+    CC_DELIM
+};
+
+// A language definition compiled for tokenize_line: a byte-to-class table
+// so each byte costs one lookup, plus the keyword hash and delimiter lengths.
+typedef struct {
+    unsigned char classes[256];
+    WordTable keywords;
+    int line_comment_len;
+    int block_comment_len[2];
+} Lexer;
+
+Lexer lexers[LANG_COUNT];
+WordTable extension_table;
+
+void init_languages() {
+    const char *extensions[LANG_COUNT * 8];
+    unsigned char extension_langs[LANG_COUNT * 8];
+    int extension_count = 0;
+
+    for (int lang = 0; lang < LANG_COUNT; lang++) {
+        const LanguageDef *def = &languages[lang];
+        Lexer *lx = &lexers[lang];
+        for (int c = 0; c < 256; c++) {
+            if (isalpha(c) || c == '_') lx->classes[c] = CC_IDENT;
+            else if (isdigit(c)) lx->classes[c] = CC_DIGIT;
+            else if (ISSPACE(c)) lx->classes[c] = CC_SPACE;
+            else lx->classes[c] = CC_OTHER;
+        }
+        for (const char *p = def->ident_chars; p && *p; p++) lx->classes[(unsigned char)*p] = CC_IDENT;
+        for (const char *p = def->quotes; p && *p; p++) lx->classes[(unsigned char)*p] = CC_QUOTE;
+        if (def->line_comment) {
+            lx->line_comment_len = STRLEN(def->line_comment);
+            lx->classes[(unsigned char)def->line_comment[0]] = CC_DELIM;
+        }
+        if (def->block_comment[0]) {
+            lx->block_comment_len[0] = STRLEN(def->block_comment[0]);
+            lx->block_comment_len[1] = STRLEN(def->block_comment[1]);
+            lx->classes[(unsigned char)def->block_comment[0][0]] = CC_DELIM;
+        }
+        if (def->preprocessor) lx->classes['#'] = CC_DELIM;
+        if (def->markup_tags) lx->classes['<'] = CC_DELIM;
+
+        int n = 0;
+        while (def->keywords && def->keywords[n]) n++;
+        word_table_build(&lx->keywords, def->keywords, NULL, n);
+
+        for (int k = 0; k < 8 && def->extensions[k]; k++) {
+            extensions[extension_count] = def->extensions[k];
+            extension_langs[extension_count++] = lang;
+        }
+    }
+    word_table_build(&extension_table, extensions, extension_langs, extension_count);
+}
+
 // Color pairs
 #define COLOR_KEYWORD 1
 #define COLOR_STRING 2
 #define COLOR_COMMENT 3
 #define COLOR_NUMBER 4
 #define COLOR_PREPROC 5
+#define COLOR_MATCH 6
+
+// Color pair used for each token type
+const int token_colors[] = {
+    [TOKEN_NORMAL] = 0,
+    [TOKEN_KEYWORD] = COLOR_KEYWORD,
+    [TOKEN_STRING] = COLOR_STRING,
+    [TOKEN_COMMENT] = COLOR_COMMENT,
+    [TOKEN_NUMBER] = COLOR_NUMBER,
+    [TOKEN_PREPROC] = COLOR_PREPROC
+};
 
 void init_colors() {
     start_color();
@@ -159,761 +838,3391 @@ void init_colors() {
     init_pair(COLOR_COMMENT, COLOR_YELLOW, COLOR_BLACK);
     init_pair(COLOR_NUMBER, COLOR_MAGENTA, COLOR_BLACK);
     init_pair(COLOR_PREPROC, COLOR_RED, COLOR_BLACK);
+    init_pair(COLOR_MATCH, COLOR_BLACK, COLOR_YELLOW);
 }
 
-void init_editor(Editor *e) {
-    e->lines = malloc(MAX_LINES * sizeof(char *));
-    e->lines[0] = malloc(MAX_LINE_LEN * sizeof(char));
-    e->lines[0][0] = '\0';
-    e->num_lines = 1;
-    e->buffers[0] = e->lines;
-    e->num_lines_buf[0] = e->num_lines;
-    e->buffers[1] = malloc(MAX_LINES * sizeof(char *));
-    e->buffers[1][0] = malloc(MAX_LINE_LEN * sizeof(char));
-    e->buffers[1][0][0] = '\0';
-    e->num_lines_buf[1] = 1;
-    e->cursor_x = e->cursor_y = e->top_line = 0;
-    e->filename = NULL;
-    e->filenames[0] = e->filenames[1] = NULL;
-    e->undo_stack = malloc(1000 * sizeof(*e->undo_stack));
-    e->undo_count = 0;
-    e->undo_size = 1000;
-    e->message[0] = '\0';
-    e->kill_ring[0] = NULL;
-    e->mark_active = false;
-    e->searching = false;
-    e->search_query[0] = '\0';
-    e->current_buffer = 0;
-    e->language = LANG_NONE;
-    e->in_multiline_comment = false;
-    initscr();
-    raw();
-    noecho();
-    keypad(stdscr, TRUE);
-    getmaxyx(stdscr, e->max_y, e->max_x);
-    signal(SIGINT, SIG_IGN);
-    init_colors();
+// Builds with COUNT_ALLOCS (micrn-bench, or make STATS=1) link with --wrap
+// for the allocation functions, so the allocations made on the main thread
+// are counted here. Other builds leave the allocator alone and count none.
+long alloc_count, alloc_bytes;
+
+#ifdef COUNT_ALLOCS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+// Set on the main thread only, so the background workers do not show up in
+// the per-frame counts and the counters need no atomics.
+__thread bool alloc_counting;
+
+void bench_count_alloc(size_t size) {
+    if (!alloc_counting) return;
+    alloc_count++;
+    alloc_bytes += size;
 }
 
-void cleanup_editor(Editor *e) {
-    for (int i = 0; i < e->num_lines_buf[0]; i++) free(e->buffers[0][i]);
-    for (int i = 0; i < e->num_lines_buf[1]; i++) free(e->buffers[1][i]);
-    free(e->buffers[0]);
-    free(e->buffers[1]);
-    if (e->filenames[0]) free(e->filenames[0]);
-    if (e->filenames[1]) free(e->filenames[1]);
-    for (int i = 0; i < e->undo_count; i++) {
-        free(e->undo_stack[i].action);
-        if (e->undo_stack[i].bulk_data) free(e->undo_stack[i].bulk_data);
-    }
-    free(e->undo_stack);
-    if (e->kill_ring[0]) free(e->kill_ring[0]);
-    endwin();
+void *__wrap_malloc(size_t size) {
+    bench_count_alloc(size);
+    return __real_malloc(size);
 }
 
-void detect_language(Editor *e) {
-    if (!e->filename) {
-        e->language = LANG_NONE;
-        return;
+void *__wrap_calloc(size_t n, size_t size) {
+    bench_count_alloc(n * size);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    bench_count_alloc(size);
+    return __real_realloc(p, size);
+}
+#endif
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int hist_index(long v) {
+    if (v < HIST_SUB_BUCKETS) return v < 0 ? 0 : v;
+    int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)(v >> shift) - HIST_SUB_BUCKETS;
+}
+
+// The largest value that falls in bucket i.
+long hist_value(int i) {
+    if (i < HIST_SUB_BUCKETS) return i;
+    int shift = i / HIST_SUB_BUCKETS - 1;
+    return ((long)(i % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void hist_record(Histogram *h, long v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+long hist_percentile(const Histogram *h, double q) {
+    long rank = (long)(q * h->total + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return hist_value(i) < h->max ? hist_value(i) : h->max;
     }
-    char *ext = strrchr(e->filename, '.');
-    if (!ext) {
-        e->language = LANG_NONE;
+    return h->max;
+}
+
+// Rounds size up to the allocation size actually handed out for it.
+int pool_block_size(int size) {
+    int block = 1 << POOL_MIN_SHIFT;
+    while (block < size) block <<= 1;
+    return block;
+}
+
+int pool_class(int block) {
+    int c = 0;
+    while ((1 << (c + POOL_MIN_SHIFT)) < block) c++;
+    return c;
+}
+
+char *pool_alloc(LinePool *p, int block) {
+    int c = pool_class(block);
+    if (c >= POOL_NUM_CLASSES) {
+        p->bytes += block;
+        return malloc(block);
+    }
+    if (p->free_lists[c]) {
+        void *ptr = p->free_lists[c];
+        p->free_lists[c] = *(void **)ptr;
+        return ptr;
+    }
+    if (p->slab_left < (size_t)block) {
+        PoolSlab *slab = malloc(POOL_SLAB_SIZE);
+        p->bytes += POOL_SLAB_SIZE;
+        slab->next = p->slabs;
+        p->slabs = slab;
+        p->slab_ptr = (char *)(slab + 1);
+        p->slab_left = POOL_SLAB_SIZE - sizeof(PoolSlab);
+    }
+    char *ptr = p->slab_ptr;
+    p->slab_ptr += block;
+    p->slab_left -= block;
+    return ptr;
+}
+
+void pool_free(LinePool *p, char *ptr, int block) {
+    int c = pool_class(block);
+    if (c >= POOL_NUM_CLASSES) {
+        p->bytes -= block;
+        free(ptr);
         return;
     }
-    if (strcmp(ext, ".html") == 0) e->language = LANG_HTML;
-    else if (strcmp(ext, ".css") == 0) e->language = LANG_CSS;
-    else if (strcmp(ext, ".c") == 0 || strcmp(ext, ".cpp") == 0) e->language = LANG_C;
-    else if (strcmp(ext, ".py") == 0) e->language = LANG_PYTHON;
-    else e->language = LANG_NONE;
+    *(void **)ptr = p->free_lists[c];
+    p->free_lists[c] = ptr;
 }
 
-void highlight_line(Editor *e, const char *line, int y) {
-    int i = 0, len = STRLEN(line);
-    bool in_string = false;
-    char string_delim = 0;
-    bool in_comment = e->in_multiline_comment;
-    bool in_line_comment = false;
-    bool in_preproc = false;
+// Keeps a block that a save is still reading until pool_release_held.
+void pool_hold(LinePool *p, char *text, int cap) {
+    if (p->held_count == p->held_capacity) {
+        p->held_capacity = p->held_capacity ? p->held_capacity * 2 : 64;
+        p->held = realloc(p->held, p->held_capacity * sizeof(Line));
+    }
+    p->held[p->held_count++] = (Line){ text, 0, cap, LEX_UNKNOWN, 0 };
+}
 
-    while (i < len) {
-        if (in_comment) {
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            while (i < len) {
-                mvaddch(y, i + 6, line[i]);
-                if (i + 1 < len && line[i] == '*' && line[i + 1] == '/') {
-                    i += 2;
-                    in_comment = false;
-                    attroff(COLOR_PAIR(COLOR_COMMENT));
-                    break;
-                }
-                i++;
-            }
-            if (i >= len) attroff(COLOR_PAIR(COLOR_COMMENT));
-            continue;
-        }
+void pool_release_held(LinePool *p) {
+    for (int i = 0; i < p->held_count; i++) pool_free(p, p->held[i].text, p->held[i].cap);
+    p->held_count = 0;
+}
 
-        if (in_line_comment) {
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            while (i < len) {
-                mvaddch(y, i + 6, line[i]);
-                i++;
-            }
-            attroff(COLOR_PAIR(COLOR_COMMENT));
-            break;
-        }
+void pool_destroy(LinePool *p) {
+    while (p->slabs) {
+        PoolSlab *next = p->slabs->next;
+        free(p->slabs);
+        p->slabs = next;
+    }
+    free(p->held);
+    memset(p, 0, sizeof(*p));
+}
 
-        if (in_string) {
-            attron(COLOR_PAIR(COLOR_STRING));
-            mvaddch(y, i + 6, line[i]);
-            if (line[i] == string_delim && (i == 0 || line[i - 1] != '\\')) {
-                in_string = false;
-                attroff(COLOR_PAIR(COLOR_STRING));
-            }
-            i++;
-            continue;
-        }
+// A small LZ77 codec in the style of LZ4, used to pack idle buffers. Each
+// sequence is a token byte holding a literal count and a match length, the
+// literals, and a 16-bit distance back to the match. Counts that do not fit
+// in their 4 bits continue in bytes of 255 and a final byte below 255. The
+// last sequence has literals only.
+int lz_bound(int n) {
+    return n + n / 255 + 16;
+}
 
-        if (in_preproc) {
-            attron(COLOR_PAIR(COLOR_PREPROC));
-            while (i < len && !ISSPACE(line[i])) {
-                mvaddch(y, i + 6, line[i]);
-                i++;
-            }
-            attroff(COLOR_PAIR(COLOR_PREPROC));
-            in_preproc = false;
-            continue;
-        }
+unsigned char *lz_put_length(unsigned char *out, int n) {
+    for (; n >= 255; n -= 255) *out++ = 255;
+    *out++ = n;
+    return out;
+}
 
-        if (e->language == LANG_HTML) {
-            if (line[i] == '<' && (i + 1 < len && (isalpha(line[i + 1]) || line[i + 1] == '!'))) {
-                attron(COLOR_PAIR(COLOR_KEYWORD));
-                while (i < len && line[i] != '>') {
-                    mvaddch(y, i + 6, line[i]);
-                    i++;
-                }
-                if (i < len) {
-                    mvaddch(y, i + 6, line[i]);
-                    i++;
-                }
-                attroff(COLOR_PAIR(COLOR_KEYWORD));
-                continue;
-            }
-        }
+unsigned char *lz_put_sequence(unsigned char *out, const unsigned char *lit, int lit_len, int dist, int match_len) {
+    unsigned char *token = out++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15) out = lz_put_length(out, lit_len - 15);
+    memcpy(out, lit, lit_len);
+    out += lit_len;
+    if (match_len == 0) return out;
+    *out++ = dist & 255;
+    *out++ = dist >> 8;
+    int m = match_len - LZ_MIN_MATCH;
+    *token |= m < 15 ? m : 15;
+    if (m >= 15) out = lz_put_length(out, m - 15);
+    return out;
+}
 
-        if (e->language == LANG_C && i == 0 && line[i] == '#') {
-            in_preproc = true;
-            attron(COLOR_PAIR(COLOR_PREPROC));
-            mvaddch(y, i + 6, line[i]);
-            i++;
+// Compresses n bytes of src into dst, which must hold lz_bound(n) bytes.
+// Matches are found through a hash of the next four bytes, keeping only the
+// latest position for each hash. Returns the compressed size.
+int lz_compress(const char *src, int n, char *dst) {
+    const unsigned char *in = (const unsigned char *)src, *end = in + n;
+    unsigned char *out = (unsigned char *)dst;
+    int table[1 << LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+    const unsigned char *anchor = in, *p = in;
+    while (p + LZ_MIN_MATCH <= end) {
+        unsigned int seq;
+        memcpy(&seq, p, 4);
+        int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = table[h];
+        table[h] = p - in;
+        if (cand < 0 || p - in - cand > 65535 || memcmp(in + cand, p, LZ_MIN_MATCH) != 0) {
+            p++;
             continue;
         }
+        const unsigned char *m = in + cand;
+        int len = LZ_MIN_MATCH;
+        while (p + len < end && p[len] == m[len]) len++;
+        out = lz_put_sequence(out, anchor, p - anchor, p - m, len);
+        p += len;
+        anchor = p;
+    }
+    out = lz_put_sequence(out, anchor, end - anchor, 0, 0);
+    return out - (unsigned char *)dst;
+}
 
-        if ((e->language == LANG_C || e->language == LANG_HTML) && i + 1 < len && line[i] == '/' && line[i + 1] == '*') {
-            in_comment = true;
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            continue;
-        }
+unsigned int lz_get_length(const unsigned char **in) {
+    unsigned int n = 0;
+    do n += **in; while (*(*in)++ == 255);
+    return n;
+}
 
-        if (e->language == LANG_C && i + 1 < len && line[i] == '/' && line[i + 1] == '/') {
-            in_line_comment = true;
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            continue;
-        }
+// Expands n bytes written by lz_compress into dst, which must hold the
+// original size.
+void lz_decompress(const char *src, int n, char *dst) {
+    const unsigned char *in = (const unsigned char *)src, *end = in + n;
+    unsigned char *out = (unsigned char *)dst;
+    while (in < end) {
+        int token = *in++;
+        int len = token >> 4;
+        if (len == 15) len += lz_get_length(&in);
+        memcpy(out, in, len);
+        out += len;
+        in += len;
+        if (in >= end) break;
+        int dist = in[0] | in[1] << 8;
+        in += 2;
+        len = token & 15;
+        if (len == 15) len += lz_get_length(&in);
+        len += LZ_MIN_MATCH;
+        // The match may overlap the bytes it produces, so copy forward.
+        const unsigned char *m = out - dist;
+        while (len-- > 0) *out++ = *m++;
+    }
+}
 
-        if (e->language == LANG_PYTHON && line[i] == '#') {
-            in_line_comment = true;
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            continue;
+// A fixed set of threads that run queued tasks. It is started on first use.
+typedef struct {
+    void (*run)(void *);
+    void *arg;
+} WorkerTask;
+
+typedef struct {
+    pthread_t threads[MAX_WORKERS];
+    int num_threads;
+    WorkerTask *queue;
+    int head, count, capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    bool stopping;
+} WorkerPool;
+
+WorkerPool workers = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+
+void *workers_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&workers.lock);
+    while (1) {
+        while (workers.count == 0 && !workers.stopping) pthread_cond_wait(&workers.ready, &workers.lock);
+        if (workers.count == 0) break;
+        WorkerTask task = workers.queue[workers.head];
+        workers.head = (workers.head + 1) % workers.capacity;
+        workers.count--;
+        pthread_mutex_unlock(&workers.lock);
+        task.run(task.arg);
+        pthread_mutex_lock(&workers.lock);
+    }
+    pthread_mutex_unlock(&workers.lock);
+    return NULL;
+}
+
+void workers_start() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+    while (workers.num_threads < wanted &&
+           pthread_create(&workers.threads[workers.num_threads], NULL, workers_main, NULL) == 0) {
+        workers.num_threads++;
+    }
+}
+
+// Queues a task. Without any threads the task simply runs inline.
+void workers_submit(void (*run)(void *), void *arg) {
+    pthread_mutex_lock(&workers.lock);
+    if (workers.num_threads == 0) workers_start();
+    if (workers.num_threads == 0) {
+        pthread_mutex_unlock(&workers.lock);
+        run(arg);
+        return;
+    }
+    if (workers.count == workers.capacity) {
+        int capacity = workers.capacity ? workers.capacity * 2 : 64;
+        WorkerTask *queue = malloc(capacity * sizeof(WorkerTask));
+        for (int i = 0; i < workers.count; i++) queue[i] = workers.queue[(workers.head + i) % workers.capacity];
+        free(workers.queue);
+        workers.queue = queue;
+        workers.head = 0;
+        workers.capacity = capacity;
+    }
+    workers.queue[(workers.head + workers.count) % workers.capacity] = (WorkerTask){ run, arg };
+    workers.count++;
+    pthread_cond_signal(&workers.ready);
+    pthread_mutex_unlock(&workers.lock);
+}
+
+// Finishes the queued tasks and joins the threads.
+void workers_stop() {
+    pthread_mutex_lock(&workers.lock);
+    workers.stopping = true;
+    pthread_cond_broadcast(&workers.ready);
+    pthread_mutex_unlock(&workers.lock);
+    for (int i = 0; i < workers.num_threads; i++) pthread_join(workers.threads[i], NULL);
+    workers.num_threads = 0;
+    free(workers.queue);
+    workers.queue = NULL;
+    workers.head = workers.count = workers.capacity = 0;
+    workers.stopping = false;
+}
+
+void line_list_push(LineList *list, const char *text, int len) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->lines = realloc(list->lines, list->capacity * sizeof(Line));
+    }
+    Line *l = &list->lines[list->count++];
+    l->text = (char *)text;
+    l->len = len;
+    l->cap = 0;
+    l->lex_state = LEX_UNKNOWN;
+    l->held_cap = 0;
+}
+
+// Newline scanning. split_lines appends a borrowed line to out for every
+// newline in [p, end) until out holds max_lines lines, and returns the start
+// of the line after the last newline it consumed. The SIMD kernels compare
+// 16 or 32 bytes at a time; init_simd picks the best one the CPU supports.
+const char *split_lines_tail(const char *start, const char *p, const char *end, LineList *out, int max_lines) {
+    while (out->count < max_lines && (p = memchr(p, '\n', end - p))) {
+        line_list_push(out, start, p - start);
+        start = ++p;
+    }
+    return start;
+}
+
+const char *split_lines_scalar(const char *p, const char *end, LineList *out, int max_lines) {
+    return split_lines_tail(p, p, end, out, max_lines);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+const char *split_lines_sse2(const char *p, const char *end, LineList *out, int max_lines) {
+    const char *start = p;
+    __m128i nl = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+        for (; mask; mask &= mask - 1) {
+            if (out->count >= max_lines) return start;
+            const char *q = p + __builtin_ctz(mask);
+            line_list_push(out, start, q - start);
+            start = q + 1;
         }
+        p += 16;
+    }
+    return split_lines_tail(start, p, end, out, max_lines);
+}
 
-        if (e->language == LANG_HTML && i + 3 < len && line[i] == '<' && line[i + 1] == '!' && line[i + 2] == '-' && line[i + 3] == '-') {
-            in_line_comment = true;
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            continue;
+__attribute__((target("avx2")))
+const char *split_lines_avx2(const char *p, const char *end, LineList *out, int max_lines) {
+    const char *start = p;
+    __m256i nl = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl));
+        for (; mask; mask &= mask - 1) {
+            if (out->count >= max_lines) return start;
+            const char *q = p + __builtin_ctz(mask);
+            line_list_push(out, start, q - start);
+            start = q + 1;
         }
+        p += 32;
+    }
+    return split_lines_tail(start, p, end, out, max_lines);
+}
+#endif
 
-        if ((e->language == LANG_C || e->language == LANG_PYTHON || e->language == LANG_CSS || e->language == LANG_HTML) &&
-            (line[i] == '"' || line[i] == '\'')) {
-            in_string = true;
-            string_delim = line[i];
-            attron(COLOR_PAIR(COLOR_STRING));
-            mvaddch(y, i + 6, line[i]);
-            i++;
-            continue;
+const char *(*split_lines)(const char *p, const char *end, LineList *out, int max_lines) = split_lines_scalar;
+
+// Substring search over line storage in place. find_forward returns the
+// offset of the first occurrence of needle in text[from, len), or -1. The
+// SIMD kernels test 16 or 32 candidate positions at once against the first
+// and last byte of the needle and only memcmp where both match.
+int find_forward_scalar(const char *text, int len, int from, const char *needle, int nlen) {
+    if (from < 0) from = 0;
+    if (len - from < nlen) return -1;
+    const char *p = text + from;
+    const char *last = text + len - nlen;
+    while (p <= last && (p = memchr(p, needle[0], last - p + 1))) {
+        if (memcmp(p, needle, nlen) == 0) return p - text;
+        p++;
+    }
+    return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+int find_forward_sse2(const char *text, int len, int from, const char *needle, int nlen) {
+    if (from < 0) from = 0;
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+    int i = from;
+    for (; i + nlen - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(text + i)), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(text + i + nlen - 1)), last);
+        for (unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, b)); mask; mask &= mask - 1) {
+            int k = i + __builtin_ctz(mask);
+            if (memcmp(text + k, needle, nlen) == 0) return k;
         }
+    }
+    return find_forward_scalar(text, len, i, needle, nlen);
+}
 
-        if (isdigit(line[i])) {
-            attron(COLOR_PAIR(COLOR_NUMBER));
-            while (i < len && (isdigit(line[i]) || line[i] == '.')) {
-                mvaddch(y, i + 6, line[i]);
-                i++;
-            }
-            attroff(COLOR_PAIR(COLOR_NUMBER));
-            continue;
+__attribute__((target("avx2")))
+int find_forward_avx2(const char *text, int len, int from, const char *needle, int nlen) {
+    if (from < 0) from = 0;
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+    int i = from;
+    for (; i + nlen - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(text + i)), first);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(text + i + nlen - 1)), last);
+        for (unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(a, b)); mask; mask &= mask - 1) {
+            int k = i + __builtin_ctz(mask);
+            if (memcmp(text + k, needle, nlen) == 0) return k;
         }
+    }
+    return find_forward_scalar(text, len, i, needle, nlen);
+}
+#endif
 
-        if (isalpha(line[i]) || line[i] == '_') {
-            char word[MAX_LINE_LEN];
-            int j = 0;
-            while (i < len && (isalnum(line[i]) || line[i] == '_') && j < MAX_LINE_LEN - 1) {
-                word[j++] = line[i++];
-            }
-            word[j] = '\0';
-            bool is_keyword = false;
-            const char **keywords = NULL;
-            if (e->language == LANG_HTML) keywords = html_keywords;
-            else if (e->language == LANG_CSS) keywords = css_keywords;
-            else if (e->language == LANG_C) keywords = c_keywords;
-            else if (e->language == LANG_PYTHON) keywords = python_keywords;
-
-            if (keywords) {
-                for (int k = 0; keywords[k]; k++) {
-                    if (strcmp(word, keywords[k]) == 0) {
-                        is_keyword = true;
-                        break;
-                    }
-                }
-            }
+int (*find_forward)(const char *text, int len, int from, const char *needle, int nlen) = find_forward_scalar;
+
+// Returns the offset of the last occurrence of needle that starts at or
+// before before, or -1.
+int find_backward(const char *text, int len, int before, const char *needle, int nlen) {
+    int k = len - nlen < before ? len - nlen : before;
+    for (; k >= 0; k--) {
+        if (text[k] == needle[0] && memcmp(text + k, needle, nlen) == 0) return k;
+    }
+    return -1;
+}
+
+int re_node(Regex *re, ReNodeType type, int left, int right) {
+    if (re->node_count == re->node_capacity) {
+        re->node_capacity = re->node_capacity ? re->node_capacity * 2 : 64;
+        re->nodes = realloc(re->nodes, re->node_capacity * sizeof(ReNode));
+    }
+    re->nodes[re->node_count] = (ReNode){ type, left, right, 0, 0 };
+    return re->node_count++;
+}
+
+int re_new_set(Regex *re) {
+    if (re->set_count == re->set_capacity) {
+        re->set_capacity = re->set_capacity ? re->set_capacity * 2 : 32;
+        re->sets = realloc(re->sets, re->set_capacity * sizeof(*re->sets));
+    }
+    memset(re->sets[re->set_count], 0, sizeof(*re->sets));
+    return re->set_count++;
+}
+
+void re_set_add(unsigned char *set, int c) {
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+// Adds the class named by the escape \c (\d, \w, \s or their upper-case
+// negations) to set, or the escaped character itself.
+void re_escape_set(unsigned char *set, int c) {
+    int lower = tolower(c);
+    if (lower == 'd' || lower == 'w' || lower == 's') {
+        bool negate = c != lower;
+        for (int k = 0; k < 256; k++) {
+            bool in = lower == 'd' ? isdigit(k) : lower == 'w' ? isalnum(k) || k == '_' : isspace(k);
+            if (in != negate) re_set_add(set, k);
+        }
+        return;
+    }
+    re_set_add(set, c == 't' ? '\t' : c);
+}
+
+typedef struct {
+    Regex *re;
+    const char *p, *end;
+} ReParser;
+
+int re_parse_alt(ReParser *ps);
+
+int re_parse_class(ReParser *ps) {
+    Regex *re = ps->re;
+    int set = re_new_set(re);
+    unsigned char *s = re->sets[set];
+    bool negate = ps->p < ps->end && *ps->p == '^';
+    if (negate) ps->p++;
+    for (bool first = true; ps->p < ps->end && (first || *ps->p != ']'); first = false) {
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && ps->p < ps->end) {
+            re_escape_set(s, (unsigned char)*ps->p++);
+        } else if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            int hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi < lo) {
+                re->error = "invalid range";
+                return -1;
+            }
+            for (int k = lo; k <= hi; k++) re_set_add(s, k);
+        } else {
+            re_set_add(s, lo);
+        }
+    }
+    if (ps->p >= ps->end) {
+        re->error = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    if (negate) {
+        for (int k = 0; k < 32; k++) s[k] ^= 0xff;
+    }
+    return re_node(re, RE_SET, set, 0);
+}
+
+int re_parse_atom(ReParser *ps) {
+    Regex *re = ps->re;
+    int c = (unsigned char)*ps->p++;
+    if (c == '(') {
+        int node = re_parse_alt(ps);
+        if (node < 0) return -1;
+        if (ps->p >= ps->end || *ps->p != ')') {
+            re->error = "missing )";
+            return -1;
+        }
+        ps->p++;
+        return node;
+    }
+    if (c == '[') return re_parse_class(ps);
+    if (c == '^') return re_node(re, RE_BOL, 0, 0);
+    if (c == '$') return re_node(re, RE_EOL, 0, 0);
+    if (c == '*' || c == '+' || c == '?') {
+        re->error = "nothing to repeat";
+        return -1;
+    }
+    if (c == '\\' && ps->p >= ps->end) {
+        re->error = "trailing backslash";
+        return -1;
+    }
+    int set = re_new_set(re);
+    if (c == '.') memset(re->sets[set], 0xff, sizeof(*re->sets));
+    else if (c == '\\') re_escape_set(re->sets[set], (unsigned char)*ps->p++);
+    else re_set_add(re->sets[set], c);
+    return re_node(re, RE_SET, set, 0);
+}
+
+// Parses {m}, {m,} or {m,n} after an atom. Anything else leaves the brace
+// to be matched literally.
+bool re_parse_bounds(ReParser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    if (p >= ps->end || !isdigit(*p)) return false;
+    *min = 0;
+    for (; p < ps->end && isdigit(*p); p++) {
+        if (*min <= RE_MAX_REPEAT) *min = *min * 10 + (*p - '0');
+    }
+    *max = *min;
+    if (p < ps->end && *p == ',') {
+        p++;
+        *max = -1;
+        if (p < ps->end && isdigit(*p)) *max = 0;
+        for (; p < ps->end && isdigit(*p); p++) {
+            if (*max <= RE_MAX_REPEAT) *max = *max * 10 + (*p - '0');
+        }
+    }
+    if (p >= ps->end || *p != '}') return false;
+    ps->p = p + 1;
+    return true;
+}
+
+int re_parse_repeat(ReParser *ps) {
+    Regex *re = ps->re;
+    int node = re_parse_atom(ps);
+    while (node >= 0 && ps->p < ps->end) {
+        int min, max;
+        char c = *ps->p;
+        if (c == '*' || c == '+' || c == '?') {
+            min = c == '+';
+            max = c == '?' ? 1 : -1;
+            ps->p++;
+        } else if (c != '{' || !re_parse_bounds(ps, &min, &max)) {
+            break;
+        }
+        if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT || (max >= 0 && max < min)) {
+            re->error = "invalid repeat count";
+            return -1;
+        }
+        node = re_node(re, RE_REPEAT, node, 0);
+        re->nodes[node].min = min;
+        re->nodes[node].max = max;
+    }
+    return node;
+}
+
+int re_parse_cat(ReParser *ps) {
+    int node = -1;
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        int next = re_parse_repeat(ps);
+        if (next < 0) return -1;
+        node = node < 0 ? next : re_node(ps->re, RE_CAT, node, next);
+    }
+    return node < 0 ? re_node(ps->re, RE_EMPTY, 0, 0) : node;
+}
+
+int re_parse_alt(ReParser *ps) {
+    int node = re_parse_cat(ps);
+    while (node >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int right = re_parse_cat(ps);
+        if (right < 0) return -1;
+        node = re_node(ps->re, RE_ALT, node, right);
+    }
+    return node;
+}
+
+int nfa_state(Dfa *d, NfaOp op, int out, int out1, int set) {
+    if (d->count == d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : 64;
+        d->states = realloc(d->states, d->capacity * sizeof(NfaState));
+    }
+    d->states[d->count] = (NfaState){ op, out, out1, set };
+    return d->count++;
+}
+
+// Compiles node n to NFA states that continue at next and returns the entry
+// state. Reversed NFAs read concatenations right to left. Returns -1 once
+// the NFA grows past RE_MAX_STATES.
+int nfa_compile(Regex *re, Dfa *d, int n, int next, bool reversed) {
+    if (next < 0 || d->count > RE_MAX_STATES) return -1;
+    ReNode node = re->nodes[n];
+    switch (node.type) {
+    case RE_SET:
+        return nfa_state(d, NFA_SET, next, -1, node.left);
+    case RE_BOL:
+        return nfa_state(d, NFA_BOL, next, -1, 0);
+    case RE_EOL:
+        return nfa_state(d, NFA_EOL, next, -1, 0);
+    case RE_CAT:
+        if (reversed) return nfa_compile(re, d, node.right, nfa_compile(re, d, node.left, next, reversed), reversed);
+        return nfa_compile(re, d, node.left, nfa_compile(re, d, node.right, next, reversed), reversed);
+    case RE_ALT: {
+        int a = nfa_compile(re, d, node.left, next, reversed);
+        int b = nfa_compile(re, d, node.right, next, reversed);
+        if (a < 0 || b < 0) return -1;
+        return nfa_state(d, NFA_SPLIT, a, b, 0);
+    }
+    case RE_REPEAT: {
+        int tail = next;
+        if (node.max < 0) {
+            tail = nfa_state(d, NFA_SPLIT, -1, next, 0);
+            int body = nfa_compile(re, d, node.left, tail, reversed);
+            if (body < 0) return -1;
+            d->states[tail].out = body;
+        } else {
+            for (int k = node.min; k < node.max && tail >= 0; k++) {
+                int body = nfa_compile(re, d, node.left, tail, reversed);
+                if (body < 0) return -1;
+                tail = nfa_state(d, NFA_SPLIT, body, next, 0);
+            }
+        }
+        for (int k = 0; k < node.min && tail >= 0; k++) tail = nfa_compile(re, d, node.left, tail, reversed);
+        return tail;
+    }
+    default:
+        return next;
+    }
+}
+
+// Adds s and every state reachable from it without consuming a byte to
+// out. Assertions whose bit is set in follow are passed through; the others
+// stay in the set, to be resolved at the edge of the line or dropped.
+void dfa_closure(Dfa *d, int s, int follow, int *out, int *n) {
+    int top = 0;
+    d->stack[top++] = s;
+    while (top > 0) {
+        s = d->stack[--top];
+        if (s < 0 || d->mark[s] == d->generation) continue;
+        d->mark[s] = d->generation;
+        NfaState *st = &d->states[s];
+        if (st->op == NFA_SPLIT) {
+            d->stack[top++] = st->out1;
+            d->stack[top++] = st->out;
+        } else if ((st->op == NFA_BOL || st->op == NFA_EOL) && (follow & (1 << st->op))) {
+            d->stack[top++] = st->out;
+        } else {
+            out[(*n)++] = s;
+        }
+    }
+}
+
+void dfa_flush(Dfa *d) {
+    for (int k = 0; k < d->dfa_count; k++) free(d->dfa[k].nfa);
+    d->dfa_count = 0;
+    for (int k = 0; k < d->table_size; k++) d->table[k] = -1;
+    for (int k = 0; k < 4; k++) d->starts[k] = -1;
+    d->flushes++;
+}
+
+int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Returns the DFA state for the NFA set nfa[0..n), building it if needed,
+// or -1 if the cache is full and must be flushed first.
+int dfa_lookup(Dfa *d, int *nfa, int n) {
+    qsort(nfa, n, sizeof(int), compare_ints);
+    unsigned int h = 2166136261u;
+    for (int k = 0; k < n; k++) h = (h ^ nfa[k]) * 16777619u;
+    unsigned int slot = h & (d->table_size - 1);
+    for (; d->table[slot] >= 0; slot = (slot + 1) & (d->table_size - 1)) {
+        DfaState *ds = &d->dfa[d->table[slot]];
+        if (ds->count == n && memcmp(ds->nfa, nfa, n * sizeof(int)) == 0) return d->table[slot];
+    }
+    if (d->dfa_count >= RE_MAX_DFA_STATES) return -1;
+    if (d->dfa_count == d->dfa_capacity) {
+        d->dfa_capacity = d->dfa_capacity ? d->dfa_capacity * 2 : 16;
+        d->dfa = realloc(d->dfa, d->dfa_capacity * sizeof(DfaState));
+    }
+    DfaState *ds = &d->dfa[d->dfa_count];
+    ds->nfa = malloc((n ? n : 1) * sizeof(int));
+    memcpy(ds->nfa, nfa, n * sizeof(int));
+    ds->count = n;
+    ds->accept = n > 0 && nfa[0] == 0;
+    memset(ds->next, -1, sizeof(ds->next));
+
+    int m = 0;
+    d->generation++;
+    for (int k = 0; k < n; k++) dfa_closure(d, ds->nfa[k], 1 << d->edge, d->work, &m);
+    ds->accept_edge = false;
+    for (int k = 0; k < m; k++) ds->accept_edge |= d->work[k] == 0;
+
+    d->table[slot] = d->dfa_count;
+    return d->dfa_count++;
+}
+
+// Builds the set in d->work into a state, flushing the cache if it is full.
+int dfa_intern(Dfa *d, int n) {
+    int s = dfa_lookup(d, d->work, n);
+    if (s < 0) {
+        dfa_flush(d);
+        s = dfa_lookup(d, d->work, n);
+    }
+    return s;
+}
+
+int dfa_start(Dfa *d, bool bol, bool eol) {
+    int key = bol | eol << 1;
+    if (d->starts[key] >= 0) return d->starts[key];
+    int n = 0;
+    d->generation++;
+    dfa_closure(d, d->start, (bol ? 1 << NFA_BOL : 0) | (eol ? 1 << NFA_EOL : 0), d->work, &n);
+    int s = dfa_intern(d, n);
+    d->starts[key] = s;
+    return s;
+}
+
+int dfa_step(Dfa *d, int s, unsigned char c) {
+    if (d->dfa[s].next[c] >= 0) return d->dfa[s].next[c];
+    int n = 0;
+    d->generation++;
+    DfaState *ds = &d->dfa[s];
+    int restart = d->unanchored ? d->restart_count : 0;
+    for (int k = 0; k < ds->count + restart; k++) {
+        NfaState *st = &d->states[k < ds->count ? ds->nfa[k] : d->restart[k - ds->count]];
+        if (st->op == NFA_SET && (d->sets[st->set][c >> 3] & (1 << (c & 7)))) dfa_closure(d, st->out, 0, d->work, &n);
+    }
+    int t = dfa_lookup(d, d->work, n);
+    if (t < 0) {
+        // The cache is full. Start it over; s goes too, so nothing is linked.
+        dfa_flush(d);
+        return dfa_lookup(d, d->work, n);
+    }
+    d->dfa[s].next[c] = t;
+    return t;
+}
+
+bool dfa_build(Dfa *d, Regex *re, bool reversed) {
+    dfa_flush(d);
+    d->count = 0;
+    int match = nfa_state(d, NFA_MATCH, -1, -1, 0);
+    d->start = nfa_compile(re, d, re->root, match, reversed);
+    if (d->start < 0) return false;
+    d->edge = reversed ? NFA_BOL : NFA_EOL;
+    d->unanchored = reversed;
+    d->sets = (const unsigned char (*)[32])re->sets;
+    d->mark = realloc(d->mark, d->count * sizeof(int));
+    memset(d->mark, 0, d->count * sizeof(int));
+    d->generation = 0;
+    d->stack = realloc(d->stack, (3 * d->count + 8) * sizeof(int));
+    d->work = realloc(d->work, d->count * sizeof(int));
+    d->restart = realloc(d->restart, d->count * sizeof(int));
+    d->restart_count = 0;
+    d->generation++;
+    dfa_closure(d, d->start, 0, d->restart, &d->restart_count);
+    if (!d->table) {
+        d->table_size = 2 * RE_MAX_DFA_STATES;
+        d->table = malloc(d->table_size * sizeof(int));
+    }
+    dfa_flush(d);
+    return true;
+}
+
+void dfa_free(Dfa *d) {
+    dfa_flush(d);
+    free(d->dfa);
+    free(d->table);
+    free(d->states);
+    free(d->mark);
+    free(d->stack);
+    free(d->work);
+    free(d->restart);
+}
+
+// Compiles pattern, replacing whatever re held before. Returns false and
+// sets re->error if the pattern is malformed or too large.
+bool regex_compile(Regex *re, const char *pattern, int len) {
+    re->node_count = re->set_count = 0;
+    re->error = NULL;
+    ReParser ps = { re, pattern, pattern + len };
+    re->root = re_parse_alt(&ps);
+    if (re->root >= 0 && ps.p < ps.end) {
+        re->error = "unmatched )";
+        re->root = -1;
+    }
+    if (re->root < 0) return false;
+    if (!dfa_build(&re->forward, re, false) || !dfa_build(&re->reverse, re, true)) {
+        re->error = "pattern too large";
+        re->root = -1;
+        return false;
+    }
+    return true;
+}
+
+void regex_free(Regex *re) {
+    dfa_free(&re->forward);
+    dfa_free(&re->reverse);
+    free(re->nodes);
+    free(re->sets);
+    free(re->starts);
+    free(re->ahead);
+}
+
+// Returns whether the forward DFA, in state s at q on the line regex_scan
+// last ran over, reaches a match end past q. That depends only on s, so
+// the answer is kept per state: every match still going at the edge of the
+// screen asks, and most of them arrive there in the same few states.
+bool regex_continues(Regex *re, const char *text, int len, int q, int s) {
+    Dfa *f = &re->forward;
+    if (!re->ahead) re->ahead = malloc(RE_MAX_DFA_STATES);
+    if (re->ahead_scan != re->scans || re->ahead_at != q || re->ahead_flushes != f->flushes) {
+        memset(re->ahead, 0, RE_MAX_DFA_STATES);
+        re->ahead_scan = re->scans;
+        re->ahead_at = q;
+        re->ahead_flushes = f->flushes;
+    }
+    if (re->ahead[s]) return re->ahead[s] > 0;
+    bool found = false;
+    for (int t = s, k = q; k < len && f->dfa[t].count > 0; ) {
+        t = dfa_step(f, t, text[k++]);
+        DfaState *fs = &f->dfa[t];
+        if (fs->accept || (k == len && fs->accept_edge)) {
+            found = true;
+            break;
+        }
+    }
+    if (re->ahead_flushes == f->flushes) re->ahead[s] = found ? 1 : -1;
+    return found;
+}
+
+// Returns the length of the longest match of re that starts at p in text,
+// or -1 if there is none. The scan stops at limit: a match that goes on
+// past it, on the line regex_scan last ran over, is cut to end there, which
+// is all that painting up to the edge of the screen needs.
+int regex_match_len(Regex *re, const char *text, int len, int p, int limit) {
+    Dfa *f = &re->forward;
+    int end = -1;
+    int s = dfa_start(f, p == 0, p == len);
+    for (int q = p; ; q++) {
+        DfaState *fs = &f->dfa[s];
+        if (fs->accept || (q == len && fs->accept_edge)) end = q;
+        if (q == len || fs->count == 0) break;
+        if (q == limit) {
+            if (regex_continues(re, text, len, q, s)) end = limit;
+            break;
+        }
+        s = dfa_step(f, s, text[q]);
+    }
+    return end < 0 ? -1 : end - p;
+}
+
+// Finds a match of re in text. Searching forward, returns the leftmost
+// match starting at or after from; backward, the rightmost one starting at
+// or before it. The reverse DFA runs from the end of the line toward from
+// and accepts exactly where a match can start; the forward DFA then measures
+// the longest match from there into *match_len. Returns -1 if none. Empty
+// matches are never found: a pattern like x* would otherwise match at every
+// position. This costs a pass over the line per call, so callers that walk
+// every match on a line use regex_scan instead.
+int regex_find(Regex *re, const char *text, int len, int from, bool backward, int *match_len) {
+    if (backward && from > len) from = len;
+    if (re->root < 0 || from < 0 || from > len) return -1;
+    Dfa *d = &re->reverse;
+    int found = -1;
+    int s = dfa_start(d, len == 0, true);
+    for (int p = len; ; p--) {
+        DfaState *ds = &d->dfa[s];
+        if (p < len && (ds->accept || (p == 0 && ds->accept_edge)) && (!backward || p <= from)) {
+            found = p;
+            if (backward) break;
+        }
+        if (p == (backward ? 0 : from)) break;
+        s = dfa_step(d, s, text[p - 1]);
+    }
+    if (found >= 0 && match_len) *match_len = regex_match_len(re, text, len, found, len);
+    return found;
+}
+
+// Runs the reverse DFA once over the whole of text and sets re->starts[p]
+// to 1 at every position p where a non-empty match starts, 0 elsewhere. Walking the
+// starts then leaves only the forward DFA to run per match.
+void regex_scan(Regex *re, const char *text, int len) {
+    if (len >= re->starts_capacity) {
+        re->starts_capacity = len + 1 > 2 * re->starts_capacity ? len + 1 : 2 * re->starts_capacity;
+        re->starts = realloc(re->starts, re->starts_capacity);
+    }
+    memset(re->starts, 0, len + 1);
+    re->scans++;
+    if (re->root < 0) return;
+    Dfa *d = &re->reverse;
+    int s = dfa_start(d, len == 0, true);
+    for (int p = len; ; p--) {
+        DfaState *ds = &d->dfa[s];
+        re->starts[p] = p < len && (ds->accept || (p == 0 && ds->accept_edge));
+        if (p == 0) break;
+        s = dfa_step(d, s, text[p - 1]);
+    }
+}
+
+void init_simd() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        split_lines = split_lines_avx2;
+        find_forward = find_forward_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        split_lines = split_lines_sse2;
+        find_forward = find_forward_sse2;
+    }
+#endif
+}
+
+// Splits the lines that start inside one chunk. The last of them may run
+// past the end of the chunk, up to the next newline.
+void index_chunk_run(void *arg) {
+    IndexChunk *c = arg;
+    IndexJob *job = c->job;
+    const char *end = job->map + job->size;
+    const char *chunk_end = job->map + c->end;
+    const char *p = job->map + c->start;
+    if (c->start > 0) {
+        p = memchr(p - 1, '\n', c->end - c->start);
+        if (p) p++;
+    }
+    if (p) {
+        const char *start = split_lines(p, chunk_end, &c->lines, INT_MAX);
+        if (start < chunk_end) {
+            const char *nl = memchr(chunk_end, '\n', end - chunk_end);
+            line_list_push(&c->lines, start, (nl ? nl : end) - start);
+        }
+    }
+    pthread_mutex_lock(&job->lock);
+    if (--job->remaining == 0) pthread_cond_broadcast(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
+
+IndexJob *index_job_start(const char *map, size_t size) {
+    IndexJob *job = calloc(1, sizeof(IndexJob));
+    job->map = map;
+    job->size = size;
+    job->num_chunks = (size + INDEX_CHUNK_SIZE - 1) / INDEX_CHUNK_SIZE;
+    job->chunks = calloc(job->num_chunks, sizeof(IndexChunk));
+    job->remaining = job->num_chunks;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+    for (int i = 0; i < job->num_chunks; i++) {
+        IndexChunk *c = &job->chunks[i];
+        c->job = job;
+        c->start = (size_t)i * INDEX_CHUNK_SIZE;
+        c->end = c->start + INDEX_CHUNK_SIZE < size ? c->start + INDEX_CHUNK_SIZE : size;
+        workers_submit(index_chunk_run, c);
+    }
+    return job;
+}
+
+bool index_job_done(IndexJob *job) {
+    pthread_mutex_lock(&job->lock);
+    bool done = job->remaining == 0;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+void index_job_wait(IndexJob *job) {
+    pthread_mutex_lock(&job->lock);
+    while (job->remaining > 0) pthread_cond_wait(&job->done, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+}
+
+void index_job_free(IndexJob *job) {
+    index_job_wait(job);
+    for (int i = 0; i < job->num_chunks; i++) free(job->chunks[i].lines.lines);
+    free(job->chunks);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->done);
+    free(job);
+}
+
+// Writes out whatever is queued in iov, resuming after short writes.
+bool save_flush(SaveJob *job, int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        pthread_mutex_lock(&job->lock);
+        job->written += w;
+        pthread_mutex_unlock(&job->lock);
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+// Writes the snapshot to a temporary file next to the target, syncs it and
+// renames it over the target, so that a crash leaves either the old file or
+// the new one. Lines go out in writev batches of up to SAVE_BATCH_BYTES;
+// lines that are still in the mapping run on into the next one, newline and
+// all, so an unchanged stretch of a large file is written as one piece.
+void save_job_run(void *arg) {
+    static char newline = '\n';
+    SaveJob *job = arg;
+    size_t path_len = strlen(job->path);
+    char *tmp = malloc(path_len + 16);
+    snprintf(tmp, path_len + 16, "%s.saveXXXXXX", job->path);
+    int fd = mkstemp(tmp);
+    int error = 0;
+    if (fd < 0 || fchmod(fd, job->mode) != 0) error = errno;
+    struct iovec iov[SAVE_IOV_MAX];
+    int n = 0;
+    size_t pending = 0;
+    for (int i = 0; !error && i < job->count; i++) {
+        Line *l = &job->lines[i];
+        bool runs_on = job->map && l->text >= job->map && l->text + l->len < job->map + job->map_size;
+        size_t len = l->len + runs_on;
+        if (n > 0 && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len == l->text) iov[n - 1].iov_len += len;
+        else iov[n++] = (struct iovec){ l->text, len };
+        if (!runs_on) iov[n++] = (struct iovec){ &newline, 1 };
+        pending += l->len + 1;
+        if (n >= SAVE_IOV_MAX - 1 || pending >= SAVE_BATCH_BYTES) {
+            if (!save_flush(job, fd, iov, n)) error = errno;
+            n = pending = 0;
+        }
+    }
+    if (!error && (!save_flush(job, fd, iov, n) || fsync(fd) != 0 || fstat(fd, &job->st) != 0)) error = errno;
+    if (fd >= 0) close(fd);
+    if (!error && rename(tmp, job->path) != 0) error = errno;
+    if (error) {
+        if (fd >= 0) unlink(tmp);
+    } else {
+        // Make the rename itself durable.
+        char *slash = strrchr(job->path, '/');
+        char *dir = slash ? strndup(job->path, slash - job->path + 1) : strdup(".");
+        int dfd = open(dir, O_RDONLY);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+    free(tmp);
+    pthread_mutex_lock(&job->lock);
+    job->error = error;
+    job->end_ns = now_ns();
+    job->done = true;
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+}
+
+bool save_job_done(SaveJob *job) {
+    pthread_mutex_lock(&job->lock);
+    bool done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+void save_job_wait(SaveJob *job) {
+    pthread_mutex_lock(&job->lock);
+    while (!job->done) pthread_cond_wait(&job->finished, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Fraction of the snapshot written so far.
+double save_job_progress(SaveJob *job) {
+    pthread_mutex_lock(&job->lock);
+    size_t written = job->written;
+    pthread_mutex_unlock(&job->lock);
+    return job->total ? (double)written / job->total : 1;
+}
+
+typedef struct {
+    pthread_t thread;
+    bool running, stopping;
+    Journal *list;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} JournalWriter;
+
+JournalWriter journals = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return false;
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+// Starts the journal over with a new header and what was appended from
+// keep on, writing it beside the old one and renaming it into place.
+void journal_rewrite(Journal *j, const char *header, size_t keep) {
+    size_t len = strlen(j->path) + 5;
+    char *tmp = malloc(len);
+    snprintf(tmp, len, "%s.tmp", j->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool ok = fd >= 0 && write_all(fd, header, JOURNAL_HEADER_SIZE);
+    char buf[64 * 1024];
+    ssize_t n;
+    for (off_t at = keep; ok && j->fd >= 0 && (n = pread(j->fd, buf, sizeof(buf), at)) > 0; at += n) {
+        ok = write_all(fd, buf, n);
+    }
+    ok = ok && fsync(fd) == 0 && rename(tmp, j->path) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok) unlink(tmp);
+    free(tmp);
+    if (j->fd >= 0) close(j->fd);
+    j->fd = open(j->path, O_RDWR | O_APPEND);
+}
+
+// Writes out what has queued up for one journal. Called without the lock;
+// the data has been taken off the journal already.
+void journal_commit(Journal *j, char *data, size_t len, bool rotate, const char *header, size_t keep, bool closing) {
+    if (j->fd < 0 && !closing) j->fd = open(j->path, O_RDWR | O_CREAT | O_APPEND | (j->existing ? 0 : O_TRUNC), 0600);
+    if (len > 0 && j->fd >= 0 && write_all(j->fd, data, len)) fdatasync(j->fd);
+    if (rotate && !closing) journal_rewrite(j, header, keep);
+    if (closing) {
+        if (j->fd >= 0) close(j->fd);
+        unlink(j->path);
+        unlink(j->base_path);
+    }
+}
+
+void journal_free(Journal *j) {
+    free(j->path);
+    free(j->base_path);
+    free(j);
+}
+
+void *journal_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&journals.lock);
+    // Once stopping, one last pass writes out what is left.
+    for (bool last = false; !last;) {
+        last = journals.stopping;
+        if (!last) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&journals.wake, &journals.lock, &until);
+        }
+        for (Journal **link = &journals.list; *link;) {
+            Journal *j = *link;
+            char *data = j->pending;
+            size_t len = j->pending_len;
+            bool rotate = j->rotate, closing = j->closing;
+            char header[JOURNAL_HEADER_SIZE];
+            memcpy(header, j->header, JOURNAL_HEADER_SIZE);
+            size_t keep = j->keep;
+            j->pending = NULL;
+            j->pending_len = j->pending_cap = 0;
+            j->rotate = false;
+            pthread_mutex_unlock(&journals.lock);
+            journal_commit(j, data, len, rotate, header, keep, closing);
+            free(data);
+            pthread_mutex_lock(&journals.lock);
+            if (closing) {
+                *link = j->next;
+                journal_free(j);
+            } else {
+                link = &j->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&journals.lock);
+    return NULL;
+}
+
+// Hands a journal to the writer, starting it on first use.
+void journals_add(Journal *j) {
+    pthread_mutex_lock(&journals.lock);
+    if (!journals.running) journals.running = pthread_create(&journals.thread, NULL, journal_main, NULL) == 0;
+    // At the end, since the writer may be holding a link to any other.
+    Journal **link = &journals.list;
+    while (*link) link = &(*link)->next;
+    *link = j;
+    pthread_mutex_unlock(&journals.lock);
+}
+
+// Finishes every queued write and close, and joins the writer.
+void journals_stop() {
+    if (!journals.running) return;
+    pthread_mutex_lock(&journals.lock);
+    journals.stopping = true;
+    pthread_cond_signal(&journals.wake);
+    pthread_mutex_unlock(&journals.lock);
+    pthread_join(journals.thread, NULL);
+    journals.running = journals.stopping = false;
+}
+
+void journal_append(Journal *j, const void *data, size_t len) {
+    pthread_mutex_lock(&journals.lock);
+    if (j->pending_len + len > j->pending_cap) {
+        j->pending_cap = (j->pending_len + len) * 2;
+        j->pending = realloc(j->pending, j->pending_cap);
+    }
+    memcpy(j->pending + j->pending_len, data, len);
+    j->pending_len += len;
+    pthread_mutex_unlock(&journals.lock);
+    j->length += len;
+}
+
+// Fills in a header for a journal whose edits apply to the file with the
+// given size and modification time. kind is JOURNAL_BASE_FILE if that is
+// the buffer's own file, or JOURNAL_BASE_CHECKPOINT.
+void journal_header(char *header, char kind, off_t size, time_t mtime) {
+    long long n[2] = { size, mtime };
+    memcpy(header, JOURNAL_MAGIC, 4);
+    header[4] = kind;
+    memcpy(header + 5, n, sizeof(n));
+}
+
+// The hidden file next to filename that ends in suffix.
+char *journal_file(const char *filename, const char *suffix) {
+    const char *slash = strrchr(filename, '/');
+    int dir = slash ? slash - filename + 1 : 0;
+    size_t len = strlen(filename) + strlen(suffix) + 2;
+    char *path = malloc(len);
+    snprintf(path, len, "%.*s.%s%s", dir, filename, filename + dir, suffix);
+    return path;
+}
+
+Journal *journal_new(const char *filename, size_t length) {
+    Journal *j = calloc(1, sizeof(Journal));
+    j->path = journal_file(filename, ".journal");
+    j->base_path = journal_file(filename, ".journal-base");
+    j->length = length;
+    j->checkpoint_at = length + JOURNAL_CHECKPOINT_BYTES;
+    j->fd = -1;
+    return j;
+}
+
+// Starts the journal over once a snapshot of the text has been written:
+// the header names the snapshot, and only what was appended after the
+// snapshot was taken, from keep on, is kept.
+void journal_rotate(Journal *j, char kind, const struct stat *st, size_t keep) {
+    pthread_mutex_lock(&journals.lock);
+    // An earlier rotation the writer has not done yet counts its offsets
+    // from its own header.
+    if (j->rotate) keep = j->keep + keep - JOURNAL_HEADER_SIZE;
+    journal_header(j->header, kind, st->st_size, st->st_mtime);
+    j->keep = keep;
+    j->rotate = true;
+    pthread_mutex_unlock(&journals.lock);
+    j->length = JOURNAL_HEADER_SIZE + j->length - keep;
+    j->checkpoint_at = j->length + JOURNAL_CHECKPOINT_BYTES;
+}
+
+// Hands the journal to the writer to be deleted; it is freed there.
+void journal_close(Journal *j) {
+    pthread_mutex_lock(&journals.lock);
+    j->closing = true;
+    pthread_mutex_unlock(&journals.lock);
+}
+
+char *journal_put_varint(char *p, unsigned int n) {
+    for (; n >= 128; n >>= 7) *p++ = (char)(n | 128);
+    *p++ = (char)n;
+    return p;
+}
+
+bool journal_get_varint(const char **p, const char *end, unsigned int *n) {
+    *n = 0;
+    for (int shift = 0; *p < end && shift < 35; shift += 7) {
+        unsigned char c = *(*p)++;
+        *n |= (unsigned int)(c & 127) << shift;
+        if (c < 128) return true;
+    }
+    return false;
+}
+
+// Journals an edit about to be made to b, starting the journal with the
+// first one. Buffers without a file have none.
+void journal_record(TextBuffer *b, UndoType type, int y, int x, const char *text, int len) {
+    if (!b->filename) return;
+    if (!b->journal) {
+        char header[JOURNAL_HEADER_SIZE];
+        journal_header(header, JOURNAL_BASE_FILE, b->disk_size, b->disk_mtime);
+        b->journal = journal_new(b->filename, 0);
+        journals_add(b->journal);
+        journal_append(b->journal, header, JOURNAL_HEADER_SIZE);
+    }
+    char head[16], *p = head;
+    *p++ = type == UNDO_INSERT ? '+' : '-';
+    p = journal_put_varint(p, y);
+    p = journal_put_varint(p, x);
+    p = journal_put_varint(p, len);
+    journal_append(b->journal, head, p - head);
+    journal_append(b->journal, text, len);
+}
+
+TextChunk *chunk_new(int len, int line_count) {
+    TextChunk *c = malloc(sizeof(TextChunk) + len + 1);
+    c->refs = 1;
+    c->len = len;
+    c->line_count = line_count;
+    c->line_ends = malloc(line_count * sizeof(int));
+    c->text[len] = '\0';
+    return c;
+}
+
+// Returns a new chunk holding a followed by b.
+TextChunk *chunk_concat(const TextChunk *a, const TextChunk *b) {
+    TextChunk *c = chunk_new(a->len + b->len, a->line_count + b->line_count - 1);
+    memcpy(c->text, a->text, a->len);
+    memcpy(c->text + a->len, b->text, b->len);
+    memcpy(c->line_ends, a->line_ends, (a->line_count - 1) * sizeof(int));
+    for (int i = 0; i < b->line_count; i++) c->line_ends[a->line_count - 1 + i] = a->len + b->line_ends[i];
+    return c;
+}
+
+TextChunk *chunk_ref(TextChunk *c) {
+    c->refs++;
+    return c;
+}
+
+void chunk_unref(TextChunk *c) {
+    if (--c->refs > 0) return;
+    free(c->line_ends);
+    free(c);
+}
+
+void line_release(LinePool *p, Line *l) {
+    if (l->cap > 0) pool_free(p, l->text, l->cap);
+    else if (l->held_cap) pool_hold(p, l->text, l->held_cap);
+    l->held_cap = 0;
+}
+
+void line_set_text(LinePool *p, Line *l, const char *text, int len) {
+    l->cap = pool_block_size(len + 1);
+    l->text = pool_alloc(p, l->cap);
+    memcpy(l->text, text, len);
+    l->text[len] = '\0';
+    l->len = len;
+    l->lex_state = LEX_UNKNOWN;
+    l->held_cap = 0;
+}
+
+// Grows the line so that it can hold len characters plus the terminator.
+// A borrowed line is copied into the pool here, the first time it changes.
+void line_reserve(LinePool *p, Line *l, int len) {
+    if (l->cap && len + 1 <= l->cap) return;
+    int cap = pool_block_size(len + 1);
+    char *text = pool_alloc(p, cap);
+    memcpy(text, l->text, l->len);
+    text[l->len] = '\0';
+    line_release(p, l);
+    l->text = text;
+    l->cap = cap;
+}
+
+// Sets up empty text. The undo log and file state are left alone, so that
+// a buffer can be read in again without losing its history.
+void buffer_init(TextBuffer *b) {
+    b->capacity = MIN_LINE_CAPACITY;
+    b->lines = malloc(b->capacity * sizeof(Line));
+    b->gap_start = 0;
+    b->gap_end = b->capacity;
+    memset(&b->pool, 0, sizeof(b->pool));
+    b->map = NULL;
+    b->map_size = b->map_scanned = 0;
+    b->index_job = NULL;
+    b->damage_start = INT_MAX;
+    b->damage_end = 0;
+    b->lex_valid = 0;
+    b->lex_dirty_lo = INT_MAX;
+    b->lex_dirty_hi = -1;
+}
+
+// Frees the text of the buffer, leaving its undo log and file state alone.
+void buffer_free_text(TextBuffer *b) {
+    if (b->index_job) index_job_free(b->index_job);
+    b->index_job = NULL;
+    for (int i = 0; i < b->gap_start; i++) line_release(&b->pool, &b->lines[i]);
+    for (int i = b->gap_end; i < b->capacity; i++) line_release(&b->pool, &b->lines[i]);
+    pool_destroy(&b->pool);
+    if (b->map) munmap((void *)b->map, b->map_size);
+    b->map = NULL;
+    for (int i = 0; i < b->pack_count; i++) free(b->packs[i].data);
+    free(b->packs);
+    b->packs = NULL;
+    b->pack_count = b->pack_capacity = 0;
+    b->packed_bytes = 0;
+    free(b->lines);
+    b->lines = NULL;
+    b->gap_start = b->gap_end = b->capacity = 0;
+}
+
+void undo_free(UndoLog *u) {
+    for (int i = 0; i < u->count; i++) {
+        if (u->records[i].chunk) chunk_unref(u->records[i].chunk);
+    }
+    free(u->records);
+    free(u->text);
+    memset(u, 0, sizeof(*u));
+}
+
+void buffer_free(TextBuffer *b) {
+    buffer_free_text(b);
+    undo_free(&b->undo);
+    if (b->journal) journal_close(b->journal);
+    b->journal = NULL;
+    free(b->filename);
+    b->filename = NULL;
+}
+
+// Number of lines split out of the file so far.
+int buffer_loaded_lines(const TextBuffer *b) {
+    return b->capacity - (b->gap_end - b->gap_start);
+}
+
+// The entry for line y as it is stored, which may be packed.
+Line *buffer_slot(TextBuffer *b, int y) {
+    if (y >= b->gap_start) y += b->gap_end - b->gap_start;
+    return &b->lines[y];
+}
+
+Line *buffer_line(TextBuffer *b, int y) {
+    Line *l = buffer_slot(b, y);
+    if (l->cap < 0) buffer_unpack(b, y);
+    return l;
+}
+
+// Records that lines [start, end) changed and need to be repainted. An end
+// of INT_MAX means everything below start moved.
+void buffer_damage(TextBuffer *b, int start, int end) {
+    if (start < b->damage_start) b->damage_start = start;
+    if (end > b->damage_end) b->damage_end = end;
+}
+
+// Records that the lexer end state of line y may have changed.
+void buffer_lex_dirty(TextBuffer *b, int y) {
+    if (y < 0) y = 0;
+    if (y < b->lex_dirty_lo) b->lex_dirty_lo = y;
+    if (y > b->lex_dirty_hi) b->lex_dirty_hi = y;
+}
+
+// Moves the gap so that it starts at line y.
+void buffer_move_gap(TextBuffer *b, int y) {
+    if (y < b->gap_start) {
+        int n = b->gap_start - y;
+        memmove(&b->lines[b->gap_end - n], &b->lines[y], n * sizeof(Line));
+        b->gap_start -= n;
+        b->gap_end -= n;
+    } else if (y > b->gap_start) {
+        int n = y - b->gap_start;
+        memmove(&b->lines[b->gap_start], &b->lines[b->gap_end], n * sizeof(Line));
+        b->gap_start += n;
+        b->gap_end += n;
+    }
+}
+
+// Makes room for at least count lines in the gap, growing geometrically.
+void buffer_reserve(TextBuffer *b, int count) {
+    if (b->gap_end - b->gap_start >= count) return;
+    int used = buffer_loaded_lines(b);
+    int new_capacity = b->capacity * 2;
+    while (new_capacity - used < count) new_capacity *= 2;
+    int tail = b->capacity - b->gap_end;
+    b->lines = realloc(b->lines, new_capacity * sizeof(Line));
+    memmove(&b->lines[new_capacity - tail], &b->lines[b->gap_end], tail * sizeof(Line));
+    b->gap_end = new_capacity - tail;
+    b->capacity = new_capacity;
+}
+
+// Inserts a new line before line y.
+void buffer_insert_line(TextBuffer *b, int y, const char *text, int len) {
+    // Splitting a packed block would leave its lines apart.
+    if (y < buffer_loaded_lines(b) && buffer_slot(b, y)->cap < 0 && buffer_slot(b, y)->len > 0) buffer_unpack(b, y);
+    buffer_reserve(b, 1);
+    buffer_move_gap(b, y);
+    buffer_damage(b, y, INT_MAX);
+    b->version++;
+    if (b->lex_valid > y) b->lex_valid++;
+    if (b->lex_dirty_hi >= y) b->lex_dirty_hi++;
+    buffer_lex_dirty(b, y - 1);
+    line_set_text(&b->pool, &b->lines[b->gap_start], text, len);
+    b->gap_start++;
+}
+
+// Splits the mapping into borrowed lines until line y exists, reading ahead
+// INDEX_BATCH_LINES so that scrolling does not index one line at a time.
+// Waits for the background index and appends every line it found past the
+// part of the mapping that has already been split lazily.
+void buffer_merge_index(TextBuffer *b) {
+    IndexJob *job = b->index_job;
+    index_job_wait(job);
+    const char *scanned = b->map + b->map_scanned;
+    buffer_damage(b, buffer_loaded_lines(b), INT_MAX);
+    buffer_move_gap(b, buffer_loaded_lines(b));
+    for (int i = 0; i < job->num_chunks; i++) {
+        LineList *list = &job->chunks[i].lines;
+        int lo = 0, hi = list->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (list->lines[mid].text < scanned) lo = mid + 1;
+            else hi = mid;
+        }
+        buffer_reserve(b, list->count - lo);
+        memcpy(&b->lines[b->gap_start], &list->lines[lo], (list->count - lo) * sizeof(Line));
+        b->gap_start += list->count - lo;
+    }
+    b->map_scanned = b->map_size;
+    index_job_free(job);
+    b->index_job = NULL;
+}
+
+void buffer_index_to(TextBuffer *b, int y) {
+    if (!b->map || b->map_scanned >= b->map_size) return;
+    int loaded = buffer_loaded_lines(b);
+    // Far jumps wait for the parallel index rather than scanning serially.
+    if (b->index_job && (index_job_done(b->index_job) || y - loaded > INDEX_BATCH_LINES * 16)) {
+        buffer_merge_index(b);
+        return;
+    }
+    int wanted = (y > INT_MAX - INDEX_BATCH_LINES ? INT_MAX : y + INDEX_BATCH_LINES) - loaded + 1;
+    const char *end = b->map + b->map_size;
+    LineList list = {0};
+    const char *start = split_lines(b->map + b->map_scanned, end, &list, wanted);
+    if (list.count < wanted && start < end) {
+        line_list_push(&list, start, end - start);
+        start = end;
+    }
+    buffer_damage(b, loaded, INT_MAX);
+    buffer_move_gap(b, loaded);
+    buffer_reserve(b, list.count);
+    memcpy(&b->lines[b->gap_start], list.lines, list.count * sizeof(Line));
+    b->gap_start += list.count;
+    b->map_scanned = start - b->map;
+    free(list.lines);
+}
+
+bool buffer_has_line(TextBuffer *b, int y) {
+    if (y < buffer_loaded_lines(b)) return true;
+    buffer_index_to(b, y);
+    return y < buffer_loaded_lines(b);
+}
+
+// Total number of lines; this indexes the whole mapping.
+int buffer_num_lines(TextBuffer *b) {
+    buffer_index_to(b, INT_MAX);
+    return buffer_loaded_lines(b);
+}
+
+// Opens filename read-only and maps it. Lines are split out lazily as they
+// are needed and are only copied into the pool once they are modified.
+bool buffer_map_file(TextBuffer *b, const char *filename, size_t size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+    b->map = map;
+    b->map_size = size;
+    b->map_scanned = 0;
+    b->index_job = index_job_start(b->map, size);
+    buffer_index_to(b, 0);
+    return true;
+}
+
+// Copies the lines still borrowed from the file mapping into the pool and
+// drops the mapping, so that the file can shrink without pulling the text
+// out from under the buffer.
+void buffer_unmap(TextBuffer *b) {
+    if (!b->map) return;
+    int count = buffer_num_lines(b);
+    for (int y = 0; y < count; y++) {
+        Line *l = buffer_slot(b, y);
+        if (l->cap == 0 && l->text >= b->map && l->text <= b->map + b->map_size) {
+            LexState state = l->lex_state;
+            line_set_text(&b->pool, l, l->text, l->len);
+            l->lex_state = state;
+        }
+    }
+    munmap((void *)b->map, b->map_size);
+    b->map = NULL;
+    b->map_size = b->map_scanned = 0;
+}
+
+// Memory held by the buffer's text, line array and undo log. Lines still
+// borrowed from a file mapping cost nothing here: the kernel can drop and
+// reread those pages on its own.
+size_t buffer_memory(const TextBuffer *b) {
+    return b->pool.bytes + b->capacity * sizeof(Line) + b->undo.capacity * sizeof(UndoRecord) + b->undo.text_cap +
+           b->packed_bytes + b->pack_capacity * sizeof(PackBlock);
+}
+
+// Moves the unpacked lines into a fresh pool and trims the line array and
+// the undo log to size, giving back what free lists and slack were holding.
+void buffer_compact(TextBuffer *b) {
+    int count = buffer_loaded_lines(b);
+    Line *lines = malloc(count * sizeof(Line));
+    LinePool pool = {0};
+    for (int y = 0; y < count; y++) {
+        Line *l = buffer_slot(b, y);
+        lines[y] = *l;
+        if (l->cap > 0) {
+            lines[y].cap = pool_block_size(l->len + 1);
+            lines[y].text = pool_alloc(&pool, lines[y].cap);
+            memcpy(lines[y].text, l->text, l->len);
+            lines[y].text[l->len] = '\0';
+            line_release(&b->pool, l);
+        }
+    }
+    pool_destroy(&b->pool);
+    free(b->lines);
+    b->pool = pool;
+    b->lines = lines;
+    b->capacity = b->gap_start = b->gap_end = count;
+
+    UndoLog *u = &b->undo;
+    if (u->capacity > u->count && u->count > 0) {
+        u->records = realloc(u->records, u->count * sizeof(UndoRecord));
+        u->capacity = u->count;
+    }
+    if (u->text_cap > u->text_len && u->text_len > 0) {
+        u->text = realloc(u->text, u->text_len);
+        u->text_cap = u->text_len;
+    }
+}
+
+void pack_free(TextBuffer *b, int slot) {
+    b->packed_bytes -= b->packs[slot].size;
+    free(b->packs[slot].data);
+    b->packs[slot].data = NULL;
+}
+
+// Packs the buffer's lines into compressed blocks of about PACK_BLOCK_SIZE
+// bytes, joined by newlines, then compacts what is left. The Line entries
+// stay in place with their lex_state, so a packed buffer keeps its
+// highlighting. Lines borrowed from a mapping are left alone; blocks end at
+// them.
+void buffer_pack(TextBuffer *b) {
+    int count = buffer_loaded_lines(b);
+    char *raw = NULL, *packed = NULL;
+    int raw_cap = 0, slot = 0;
+    for (int y = 0; y < count;) {
+        if (buffer_slot(b, y)->cap <= 0) {
+            y++;
+            continue;
+        }
+        int first = y, size = 0;
+        for (; y < count; y++) {
+            Line *l = buffer_slot(b, y);
+            if (l->cap <= 0 || (size > 0 && size + l->len >= PACK_BLOCK_SIZE)) break;
+            if (size + l->len + 1 > raw_cap) {
+                raw_cap = (size + l->len + 1) * 2;
+                raw = realloc(raw, raw_cap);
+                packed = realloc(packed, lz_bound(raw_cap));
+            }
+            memcpy(raw + size, l->text, l->len);
+            size += l->len;
+            raw[size++] = '\n';
+        }
+        while (slot < b->pack_count && b->packs[slot].data) slot++;
+        if (slot == b->pack_count) {
+            if (b->pack_count == b->pack_capacity) {
+                b->pack_capacity = b->pack_capacity ? b->pack_capacity * 2 : 16;
+                b->packs = realloc(b->packs, b->pack_capacity * sizeof(PackBlock));
+            }
+            b->pack_count++;
+        }
+        PackBlock *p = &b->packs[slot];
+        p->size = lz_compress(raw, size, packed);
+        p->data = malloc(p->size);
+        memcpy(p->data, packed, p->size);
+        p->raw_size = size;
+        p->live = y - first;
+        b->packed_bytes += p->size;
+        for (int i = first; i < y; i++) {
+            Line *l = buffer_slot(b, i);
+            line_release(&b->pool, l);
+            l->text = NULL;
+            l->cap = -1 - slot;
+            l->len = i - first;
+        }
+    }
+    free(raw);
+    free(packed);
+    buffer_compact(b);
+}
+
+// Expands the block holding line y back into the pool.
+void buffer_unpack(TextBuffer *b, int y) {
+    Line *l = buffer_slot(b, y);
+    int slot = -1 - l->cap;
+    PackBlock *p = &b->packs[slot];
+    char *raw = malloc(p->raw_size);
+    lz_decompress(p->data, p->size, raw);
+    const char *text = raw;
+    for (int i = y - l->len, n = 0; n < p->live; i++, n++) {
+        Line *line = buffer_slot(b, i);
+        const char *nl = memchr(text, '\n', raw + p->raw_size - text);
+        unsigned char state = line->lex_state;
+        line_set_text(&b->pool, line, text, nl - text);
+        line->lex_state = state;
+        text = nl + 1;
+    }
+    free(raw);
+    pack_free(b, slot);
+}
+
+// True if the buffer holds exactly what its file on disk does, so that its
+// text can be dropped and read back later.
+bool buffer_matches_file(TextBuffer *b) {
+    struct stat st;
+    if (!b->filename || b->version != b->saved_version || stat(b->filename, &st) != 0) return false;
+    return st.st_mtime == b->disk_mtime && st.st_size == b->disk_size;
+}
+
+void buffer_delete_lines(TextBuffer *b, int y, int count) {
+    // Blocks cut at either end are unpacked; the ones in between go whole.
+    if (count > 0) {
+        buffer_line(b, y);
+        buffer_line(b, y + count - 1);
+    }
+    buffer_move_gap(b, y);
+    buffer_damage(b, y, INT_MAX);
+    b->version++;
+    if (b->lex_valid > y) b->lex_valid = b->lex_valid > y + count ? b->lex_valid - count : y;
+    if (b->lex_dirty_hi >= y) b->lex_dirty_hi = b->lex_dirty_hi >= y + count ? b->lex_dirty_hi - count : y - 1;
+    buffer_lex_dirty(b, y - 1);
+    for (int i = 0; i < count; i++) {
+        Line *l = &b->lines[b->gap_end + i];
+        if (l->cap < 0 && --b->packs[-1 - l->cap].live == 0) pack_free(b, -1 - l->cap);
+        line_release(&b->pool, l);
+    }
+    b->gap_end += count;
+}
+
+// Inserts text without newlines at x on line y.
+void buffer_insert_text(TextBuffer *b, int y, int x, const char *text, int len) {
+    Line *l = buffer_line(b, y);
+    buffer_damage(b, y, y + 1);
+    b->version++;
+    buffer_lex_dirty(b, y);
+    line_reserve(&b->pool, l, l->len + len);
+    memmove(l->text + x + len, l->text + x, l->len - x + 1);
+    memcpy(l->text + x, text, len);
+    l->len += len;
+}
+
+void buffer_delete_text(TextBuffer *b, int y, int x, int len) {
+    Line *l = buffer_line(b, y);
+    buffer_damage(b, y, y + 1);
+    b->version++;
+    buffer_lex_dirty(b, y);
+    line_reserve(&b->pool, l, l->len);
+    memmove(l->text + x, l->text + x + len, l->len - x - len + 1);
+    l->len -= len;
+}
+
+// Replaces the text of line y. Its cached lexer start state still holds,
+// since that depends only on the lines above.
+void buffer_set_line(TextBuffer *b, int y, const char *text, int len) {
+    Line *l = buffer_line(b, y);
+    buffer_damage(b, y, y + 1);
+    b->version++;
+    buffer_lex_dirty(b, y);
+    unsigned char state = l->lex_state;
+    line_release(&b->pool, l);
+    line_set_text(&b->pool, l, text, len);
+    l->lex_state = state;
+}
+
+// Breaks line y at x, moving the tail onto a new line below it.
+void buffer_split_line(TextBuffer *b, int y, int x) {
+    Line *l = buffer_line(b, y);
+    buffer_insert_line(b, y + 1, l->text + x, l->len - x);
+    buffer_delete_text(b, y, x, buffer_line(b, y)->len - x);
+}
+
+// Appends line y + 1 to line y and removes it.
+void buffer_join_lines(TextBuffer *b, int y) {
+    Line *next = buffer_line(b, y + 1);
+    buffer_insert_text(b, y, buffer_line(b, y)->len, next->text, next->len);
+    buffer_delete_lines(b, y + 1, 1);
+}
+
+// Inserts text that may contain newlines at *y, *x and leaves *y, *x at the
+// end of the inserted text.
+void buffer_insert_string(TextBuffer *b, int *y, int *x, const char *text, int len) {
+    const char *end = text + len;
+    while (text < end) {
+        const char *nl = memchr(text, '\n', end - text);
+        int n = nl ? nl - text : end - text;
+        buffer_insert_text(b, *y, *x, text, n);
+        *x += n;
+        text += n;
+        if (nl) {
+            buffer_split_line(b, *y, *x);
+            (*y)++;
+            *x = 0;
+            text++;
+        }
+    }
+}
+
+// Splices the lines of c in at *y, *x and leaves *y, *x at the end of them.
+// The lines in the middle go straight into the gap, so a paste of any size
+// moves the text after the cursor once.
+void buffer_insert_chunk(TextBuffer *b, int *y, int *x, const TextChunk *c) {
+    if (c->line_count == 1) {
+        buffer_insert_text(b, *y, *x, c->text, c->len);
+        *x += c->len;
+        return;
+    }
+    buffer_split_line(b, *y, *x);
+    buffer_insert_text(b, *y, *x, c->text, c->line_ends[0]);
+    for (int i = 1; i < c->line_count - 1; i++) {
+        int start = c->line_ends[i - 1] + 1;
+        buffer_insert_line(b, *y + i, c->text + start, c->line_ends[i] - start);
+    }
+    int last = c->line_ends[c->line_count - 2] + 1;
+    *y += c->line_count - 1;
+    *x = c->len - last;
+    buffer_insert_text(b, *y, 0, c->text + last, *x);
+}
+
+// Copies the text between two positions into a new chunk, joining lines
+// with newlines.
+TextChunk *buffer_copy_range(TextBuffer *b, int y1, int x1, int y2, int x2) {
+    size_t len = 0;
+    for (int y = y1; y <= y2; y++) {
+        int from = y == y1 ? x1 : 0;
+        int to = y == y2 ? x2 : buffer_line(b, y)->len;
+        len += to - from + (y < y2);
+    }
+    TextChunk *c = chunk_new(len, y2 - y1 + 1);
+    char *p = c->text;
+    for (int y = y1; y <= y2; y++) {
+        Line *l = buffer_line(b, y);
+        int from = y == y1 ? x1 : 0;
+        int to = y == y2 ? x2 : l->len;
+        memcpy(p, l->text + from, to - from);
+        p += to - from;
+        c->line_ends[y - y1] = p - c->text;
+        if (y < y2) *p++ = '\n';
+    }
+    return c;
+}
+
+// Copies text into a new chunk, finding its line breaks.
+TextChunk *chunk_from_text(const char *text, int len) {
+    int line_count = 1;
+    for (const char *p = text; (p = memchr(p, '\n', text + len - p)); p++) line_count++;
+    TextChunk *c = chunk_new(len, line_count);
+    memcpy(c->text, text, len);
+    int n = 0;
+    for (const char *p = text; (p = memchr(p, '\n', text + len - p)); p++) c->line_ends[n++] = p - text;
+    c->line_ends[n] = len;
+    return c;
+}
+
+void buffer_delete_range(TextBuffer *b, int y1, int x1, int y2, int x2) {
+    if (y1 == y2) {
+        buffer_delete_text(b, y1, x1, x2 - x1);
+        return;
+    }
+    buffer_delete_text(b, y1, x1, buffer_line(b, y1)->len - x1);
+    buffer_delete_text(b, y2, 0, x2);
+    if (y2 - y1 > 1) buffer_delete_lines(b, y1 + 1, y2 - y1 - 1);
+    buffer_join_lines(b, y1);
+}
+
+// The terminal the editor draws on. Normally that is the tty. A --bench run
+// opens a headless screen instead, which reads keys from a trace file and
+// writes to a scratch file so that the bytes sent can be counted.
+typedef struct {
+    SCREEN *screen;
+    FILE *in, *out;
+    bool headless;
+} Terminal;
+
+Terminal term;
+
+void term_open() {
+    if (!term.headless) {
+        term.in = stdin;
+        term.out = stdout;
+    } else {
+        // ncurses takes the size of a screen that is not a tty from these.
+        char size[16];
+        snprintf(size, sizeof(size), "%d", BENCH_LINES);
+        setenv("LINES", size, 1);
+        snprintf(size, sizeof(size), "%d", BENCH_COLS);
+        setenv("COLUMNS", size, 1);
+    }
+    term.screen = newterm(term.headless ? BENCH_TERM : NULL, term.out, term.in);
+    if (!term.screen) {
+        fprintf(stderr, "micrn: cannot open the terminal\n");
+        exit(1);
+    }
+    set_term(term.screen);
+    // Ask the terminal to bracket pastes, so they arrive as one edit.
+    fputs("\033[?2004h", term.out);
+    fflush(term.out);
+}
+
+void term_close() {
+    endwin();
+    fputs("\033[?2004l", term.out);
+    fflush(term.out);
+    delscreen(term.screen);
+}
+
+// Bytes written to a headless terminal so far.
+long term_bytes_written() {
+    struct stat st;
+    fflush(term.out);
+    return fstat(fileno(term.out), &st) == 0 ? st.st_size : 0;
+}
+
+void init_editor(Editor *e) {
+    e->buf = NULL;
+    e->buffers = NULL;
+    e->num_buffers = e->buffers_capacity = 0;
+    e->cursor_x = e->cursor_y = e->top_line = 0;
+    e->message[0] = '\0';
+    if (e->kill_ring_size < 1) e->kill_ring_size = 1;
+    e->kill_ring = calloc(e->kill_ring_size, sizeof(TextChunk *));
+    e->kill_head = e->kill_count = 0;
+    e->kill_buf = e->yank_buf = NULL;
+    e->mark_active = false;
+    e->searching = false;
+    e->search_query[0] = '\0';
+    e->search_len = 0;
+    memset(&e->regex, 0, sizeof(e->regex));
+    e->current_buffer = 0;
+    e->buffer_clock = 0;
+    e->language = LANG_NONE;
+    e->inotify_fd = -1;
+    term_open();
+    raw();
+    noecho();
+    keypad(stdscr, TRUE);
+    idlok(stdscr, TRUE);
+    scrollok(stdscr, TRUE);
+    resize_screen(e);
+    signal(SIGINT, SIG_IGN);
+    init_colors();
+    init_simd();
+    init_languages();
+}
+
+void cleanup_editor(Editor *e) {
+    stats_dump(e);
+    for (int i = 0; i < e->num_buffers; i++) {
+        // A save asked for during a checkpoint starts when it ends.
+        while (e->buffers[i]->save) {
+            save_job_wait(e->buffers[i]->save);
+            save_finish(e, e->buffers[i]);
+        }
+        buffer_free(e->buffers[i]);
+        free(e->buffers[i]);
+    }
+    free(e->buffers);
+    for (int i = 0; i < e->kill_ring_size; i++) {
+        if (e->kill_ring[i]) chunk_unref(e->kill_ring[i]);
+    }
+    free(e->kill_ring);
+    workers_stop();
+    journals_stop();
+    if (e->inotify_fd >= 0) close(e->inotify_fd);
+    free(e->dirty_rows);
+    free(e->spans.spans);
+    for (int i = 0; i < LEX_MARK_LINES; i++) free(e->lex_marks[i].marks);
+    regex_free(&e->regex);
+    for (int i = 0; i < MATCH_CACHE_LINES; i++) free(e->match_cache[i].matches);
+    term_close();
+}
+
+void detect_language(Editor *e) {
+    e->buf->lex_valid = 0;
+    e->full_redraw = true;
+    if (!e->buf->filename) {
+        e->language = LANG_NONE;
+        return;
+    }
+    char *ext = strrchr(e->buf->filename, '.');
+    if (!ext) {
+        e->language = LANG_NONE;
+        return;
+    }
+    int slot = word_table_find(&extension_table, ext, STRLEN(ext));
+    e->language = slot < 0 ? LANG_NONE : extension_table.values[slot];
+}
+
+void span_push(SpanList *list, int start, int len, TokenType type) {
+    if (!list || len <= 0) return;
+    if (list->count > 0) {
+        Span *last = &list->spans[list->count - 1];
+        if (last->type == type && last->start + last->len == start) {
+            last->len += len;
+            return;
+        }
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->spans = realloc(list->spans, list->capacity * sizeof(Span));
+    }
+    list->spans[list->count++] = (Span){ start, len, type };
+}
+
+bool lex_match(const char *p, const char *end, const char *delim, int len) {
+    return len > 0 && end - p >= len && memcmp(p, delim, len) == 0;
+}
+
+// Splits a line into attributed spans without drawing anything. state is
+// the lexer state at the start of the line; the state at the end of the line
+// is returned. With a NULL out only the state is computed. All language
+// specifics come from the compiled Lexer, so every byte is classified with a
+// single table lookup and the loop never branches on the language itself.
+//
+// tokenize_range does the same for the tokens starting in [from, stop):
+// from is 0 or a LexMark, whose state is passed in place of the line's, and
+// the result is only meaningful if stop is len. If marks is not NULL, a
+// mark is recorded every LEX_MARK_INTERVAL bytes along the way.
+LexState tokenize_range(Editor *e, const char *line, int len, int from, int stop, LexState state, SpanList *out, LexMarks *marks) {
+    const LanguageDef *def = &languages[e->language];
+    const Lexer *lx = &lexers[e->language];
+    const char *end = line + len;
+    int i = from;
+    int next_mark = LEX_MARK_INTERVAL;
+    if (out) out->count = 0;
+    bool continued = len > 0 && line[len - 1] == '\\';
+    bool directive = state == LEX_PREPROC;
+
+    if (state == LEX_STRING_DQ || state == LEX_STRING_SQ) {
+        char string_delim = state == LEX_STRING_DQ ? '"' : '\'';
+        while (i < len && !(line[i] == string_delim && (i == 0 || line[i - 1] != '\\'))) i++;
+        if (i < len) i++;
+        span_push(out, 0, i, TOKEN_STRING);
+        if (i >= len && continued) return state;
+    } else if (state == LEX_TRIPLE_DQ || state == LEX_TRIPLE_SQ) {
+        char string_delim = state == LEX_TRIPLE_DQ ? '"' : '\'';
+        while (i < len && !(i + 2 < len && line[i] == string_delim && line[i + 1] == string_delim && line[i + 2] == string_delim)) i++;
+        if (i >= len) {
+            span_push(out, 0, len, TOKEN_STRING);
+            return state;
+        }
+        i += 3;
+        span_push(out, 0, i, TOKEN_STRING);
+    }
+    bool in_comment = state == LEX_COMMENT;
+
+    while (i < stop) {
+        int start = i;
+        if (marks && start >= next_mark) {
+            if (marks->count == marks->capacity) {
+                marks->capacity = marks->capacity ? marks->capacity * 2 : 16;
+                marks->marks = realloc(marks->marks, marks->capacity * sizeof(LexMark));
+            }
+            marks->marks[marks->count++] = (LexMark){ start, in_comment ? LEX_COMMENT : LEX_NORMAL };
+            next_mark = start + LEX_MARK_INTERVAL;
+        }
+        if (in_comment) {
+            const char *close = def->block_comment[1];
+            int close_len = lx->block_comment_len[1];
+            while (i < len && !lex_match(line + i, end, close, close_len)) {
+                const char *next = memchr(line + i + 1, close[0], len - i - 1);
+                i = next ? next - line : len;
+            }
+            if (i < len) {
+                i += close_len;
+                in_comment = false;
+            }
+            span_push(out, start, i - start, TOKEN_COMMENT);
+            continue;
+        }
+
+        unsigned char cls = lx->classes[(unsigned char)line[i]];
+        if (cls == CC_IDENT) {
+            while (i < len && (lx->classes[(unsigned char)line[i]] == CC_IDENT || lx->classes[(unsigned char)line[i]] == CC_DIGIT)) i++;
+            if (!out) continue;
+            bool is_keyword = word_table_find(&lx->keywords, line + start, i - start) >= 0;
+            span_push(out, start, i - start, is_keyword ? TOKEN_KEYWORD : TOKEN_NORMAL);
+            continue;
+        }
+
+        if (cls == CC_DIGIT) {
+            while (i < len && (lx->classes[(unsigned char)line[i]] == CC_IDENT || lx->classes[(unsigned char)line[i]] == CC_DIGIT || line[i] == '.')) i++;
+            span_push(out, start, i - start, TOKEN_NUMBER);
+            continue;
+        }
+
+        if (cls == CC_QUOTE) {
+            char string_delim = line[i];
+            if (def->triple_quotes && i + 2 < len && line[i + 1] == string_delim && line[i + 2] == string_delim) {
+                i += 3;
+                while (i < len && !(i + 2 < len && line[i] == string_delim && line[i + 1] == string_delim && line[i + 2] == string_delim)) i++;
+                if (i >= len) {
+                    span_push(out, start, len - start, TOKEN_STRING);
+                    return string_delim == '"' ? LEX_TRIPLE_DQ : LEX_TRIPLE_SQ;
+                }
+                i += 3;
+                span_push(out, start, i - start, TOKEN_STRING);
+                continue;
+            }
+            i++;
+            while (i < len && !(line[i] == string_delim && line[i - 1] != '\\')) i++;
+            if (i >= len) {
+                span_push(out, start, len - start, TOKEN_STRING);
+                if (continued && string_delim == '"') return LEX_STRING_DQ;
+                if (continued && string_delim == '\'') return LEX_STRING_SQ;
+                break;
+            }
+            i++;
+            span_push(out, start, i - start, TOKEN_STRING);
+            continue;
+        }
+
+        if (cls == CC_DELIM) {
+            if (def->preprocessor && i == 0 && line[i] == '#' && state == LEX_NORMAL) {
+                directive = true;
+                i++;
+                while (i < len && !ISSPACE(line[i])) i++;
+                span_push(out, start, i - start, TOKEN_PREPROC);
+                continue;
+            }
+            if (lex_match(line + i, end, def->block_comment[0], lx->block_comment_len[0])) {
+                in_comment = true;
+                i += lx->block_comment_len[0];
+                span_push(out, start, i - start, TOKEN_COMMENT);
+                continue;
+            }
+            if (lex_match(line + i, end, def->line_comment, lx->line_comment_len)) {
+                span_push(out, start, len - start, TOKEN_COMMENT);
+                return directive && continued ? LEX_PREPROC : LEX_NORMAL;
+            }
+            if (def->markup_tags && line[i] == '<' && i + 1 < len && (isalpha(line[i + 1]) || line[i + 1] == '!' || line[i + 1] == '/')) {
+                while (i < len && line[i] != '>') i++;
+                if (i < len) i++;
+                span_push(out, start, i - start, TOKEN_KEYWORD);
+                continue;
+            }
+            span_push(out, start, 1, TOKEN_NORMAL);
+            i++;
+            continue;
+        }
+
+        // Plain punctuation and whitespace go out as one span per run.
+        while (i < len && lx->classes[(unsigned char)line[i]] <= CC_SPACE) i++;
+        span_push(out, start, i - start, TOKEN_NORMAL);
+    }
+
+    if (in_comment) return LEX_COMMENT;
+    return directive && continued ? LEX_PREPROC : LEX_NORMAL;
+}
+
+LexState tokenize_line(Editor *e, const char *line, int len, LexState state, SpanList *out) {
+    return tokenize_range(e, line, len, 0, len, state, out, NULL);
+}
+
+// Returns the last token boundary recorded at or before x on line y,
+// recording the boundaries along the whole line first if they are not
+// cached. Without one, tokenizing starts from the beginning of the line.
+LexMark lex_mark_before(Editor *e, int y, int x) {
+    LexMarks *m = &e->lex_marks[y & (LEX_MARK_LINES - 1)];
+    Line *line = buffer_line(e->buf, y);
+    if (m->buf != e->buf || m->y != y || m->state != line->lex_state) {
+        m->buf = e->buf;
+        m->y = y;
+        m->state = line->lex_state;
+        m->count = 0;
+        tokenize_range(e, line->text, line->len, 0, line->len, line->lex_state, NULL, m);
+    }
+    int lo = 0, hi = m->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m->marks[mid].offset <= x) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > 0 ? m->marks[lo - 1] : (LexMark){ 0, line->lex_state };
+}
+
+// Forgets the token boundaries cached for lines start to end - 1.
+void lex_marks_invalidate(Editor *e, int start, int end) {
+    for (int i = 0; i < LEX_MARK_LINES; i++) {
+        if (e->lex_marks[i].y >= start && e->lex_marks[i].y < end) e->lex_marks[i].buf = NULL;
+    }
+}
+
+// Clips a span to the columns on screen, from left_col to the right edge.
+// Returns false if none of it is visible.
+bool clip_span(Editor *e, const Span *s, int *start, int *len) {
+    int left = e->left_col, right = e->left_col + e->max_x - e->gutter;
+    *start = s->start > left ? s->start : left;
+    int end = s->start + s->len < right ? s->start + s->len : right;
+    *len = end - *start;
+    return *len > 0;
+}
+
+// Paints spans on screen row y, one ncurses call per span, clipped to the
+// visible columns.
+void render_spans(Editor *e, const char *line, const SpanList *spans, int y) {
+    for (int k = 0; k < spans->count; k++) {
+        const Span *s = &spans->spans[k];
+        int start, len;
+        if (!clip_span(e, s, &start, &len)) continue;
+        int pair = token_colors[s->type];
+        if (pair) attron(COLOR_PAIR(pair));
+        mvaddnstr(y, start - e->left_col + e->gutter, line + start, len);
+        if (pair) attroff(COLOR_PAIR(pair));
+    }
+}
+
+// Brings the cached lexer states up to date through line upto. Edited lines
+// are relexed forward, past the last of them, until a line's end state
+// matches the start state already cached for the next one; lines past
+// lex_valid are lexed once and then stay cached, so scrolling never
+// rescans from the top.
+void highlight_sync(Editor *e, int upto) {
+    TextBuffer *b = e->buf;
+    if (!buffer_has_line(b, 0)) return;
+    buffer_line(b, 0)->lex_state = LEX_NORMAL;
+    if (b->lex_valid == 0) b->lex_valid = 1;
+    for (int y = b->lex_dirty_lo; y < b->lex_valid - 1; y++) {
+        Line *line = buffer_line(b, y);
+        LexState end = tokenize_line(e, line->text, line->len, line->lex_state, NULL);
+        Line *next = buffer_line(b, y + 1);
+        if (next->lex_state == end) {
+            if (y >= b->lex_dirty_hi) break;
+            continue;
+        }
+        next->lex_state = end;
+        buffer_damage(b, y + 1, y + 2);
+    }
+    b->lex_dirty_lo = INT_MAX;
+    b->lex_dirty_hi = -1;
+    while (b->lex_valid <= upto && buffer_has_line(b, b->lex_valid)) {
+        Line *line = buffer_line(b, b->lex_valid - 1);
+        buffer_line(b, b->lex_valid)->lex_state = tokenize_line(e, line->text, line->len, line->lex_state, NULL);
+        b->lex_valid++;
+    }
+}
+
+// Paints the matches of the search in progress on screen row y, over the
+// syntax colors.
+void render_matches(Editor *e, const char *line, const MatchLine *m, int y) {
+    attron(COLOR_PAIR(COLOR_MATCH));
+    for (int k = 0; k < m->count; k++) {
+        int start, len;
+        if (clip_span(e, &m->matches[k], &start, &len)) mvaddnstr(y, start - e->left_col + e->gutter, line + start, len);
+    }
+    attroff(COLOR_PAIR(COLOR_MATCH));
+}
+
+// Paints line y on screen row row. Only the tokens up to the right edge of
+// the screen are made, and a line scrolled far to the right is tokenized
+// from the last mark before left_col, so a 100 KB line costs about as much
+// as a short one.
+void highlight_line(Editor *e, int y, int row) {
+    Line *line = buffer_line(e->buf, y);
+    if (line->len <= e->left_col) return;
+    int stop = e->left_col + e->max_x - e->gutter;
+    LexMark from = { 0, line->lex_state };
+    if (e->left_col >= LEX_MARK_INTERVAL) from = lex_mark_before(e, y, e->left_col);
+    tokenize_range(e, line->text, line->len, from.offset, stop < line->len ? stop : line->len, from.state, &e->spans, NULL);
+    render_spans(e, line->text, &e->spans, row);
+    if (e->searching && e->search_len > 0 && !e->search_failed[e->search_len]) {
+        render_matches(e, line->text, search_matches(e, y), row);
+    }
+}
+
+// Shifts the text area by delta rows using the terminal's own scrolling,
+// so only the newly exposed rows have to be painted.
+void scroll_screen(Editor *e, int delta) {
+    int display_lines = e->max_y - 1;
+    scrl(delta);
+    if (delta > 0) {
+        memmove(e->dirty_rows, e->dirty_rows + delta, (display_lines - delta) * sizeof(bool));
+        for (int i = display_lines - delta; i < display_lines; i++) e->dirty_rows[i] = true;
+    } else {
+        delta = -delta;
+        memmove(e->dirty_rows + delta, e->dirty_rows, (display_lines - delta) * sizeof(bool));
+        for (int i = 0; i < delta; i++) e->dirty_rows[i] = true;
+    }
+}
+
+void draw(Editor *e) {
+    int display_lines = e->max_y - 1;
+    TextBuffer *b = e->buf;
+    if (e->top_line < 0) e->top_line = 0;
+    if (!buffer_has_line(b, e->top_line)) e->top_line = buffer_num_lines(b) - 1;
+    if (e->cursor_y < e->top_line) e->top_line = e->cursor_y;
+    if (e->cursor_y >= e->top_line + display_lines) e->top_line = e->cursor_y - display_lines + 1;
+    // Line numbers take at least 4 digits, and as many as the last line
+    // indexed so far needs, so the text stays lined up past line 9999.
+    int gutter = 6;
+    for (int n = buffer_loaded_lines(b); n >= 10000; n /= 10) gutter++;
+    if (gutter != e->gutter) e->full_redraw = true;
+    e->gutter = gutter;
+    // Scroll sideways by half a screen when the cursor leaves the view.
+    int width = e->max_x - e->gutter;
+    if (e->cursor_x < e->left_col || e->cursor_x >= e->left_col + width) {
+        e->left_col = e->cursor_x < width ? 0 : e->cursor_x - width / 2;
+    }
+    if (e->left_col != e->drawn_left_col) e->full_redraw = true;
+    e->drawn_left_col = e->left_col;
+
+    int delta = e->top_line - e->drawn_top_line;
+    if (!e->full_redraw && delta != 0) {
+        if (abs(delta) < display_lines) scroll_screen(e, delta);
+        else e->full_redraw = true;
+    }
+    if (e->full_redraw) {
+        erase();
+        for (int i = 0; i < display_lines; i++) e->dirty_rows[i] = true;
+        e->drawn_message[0] = '\0';
+        e->full_redraw = false;
+        lex_marks_invalidate(e, 0, INT_MAX);
+    }
+    long start = e->stats.enabled ? now_ns() : 0;
+    highlight_sync(e, e->top_line + display_lines);
+    if (b->damage_start < b->damage_end) {
+        int first = b->damage_start - e->top_line;
+        int last = b->damage_end == INT_MAX ? display_lines : b->damage_end - e->top_line;
+        for (int i = first < 0 ? 0 : first; i < last && i < display_lines; i++) e->dirty_rows[i] = true;
+        lex_marks_invalidate(e, b->damage_start, b->damage_end);
+        b->damage_start = INT_MAX;
+        b->damage_end = 0;
+    }
+    e->drawn_top_line = e->top_line;
+
+    for (int i = 0; i < display_lines; i++) {
+        if (!e->dirty_rows[i]) continue;
+        e->dirty_rows[i] = false;
+        int y = i + e->top_line;
+        move(i, 0);
+        clrtoeol();
+        if (buffer_has_line(b, y)) {
+            mvprintw(i, 0, "%*d: ", e->gutter - 2, y + 1);
+            highlight_line(e, y, i);
+        }
+    }
+    if (e->stats.enabled) e->stats.highlight_ns += now_ns() - start;
+
+    const char *message = e->message[0] || !e->stats.overlay ? e->message : e->stats.overlay_text;
+    if (strcmp(message, e->drawn_message) != 0) {
+        move(e->max_y - 1, 0);
+        clrtoeol();
+        mvprintw(e->max_y - 1, 0, "%.*s", e->max_x - 1, message);
+        snprintf(e->drawn_message, sizeof(e->drawn_message), "%s", message);
+    }
+    move(e->cursor_y - e->top_line, e->cursor_x - e->left_col + e->gutter);
+    refresh();
+}
+
+// Reads a line of input typed on the message line.
+void read_prompt(Editor *e, const char *label, char *out, int size) {
+    snprintf(e->message, sizeof(e->message), "%s", label);
+    draw(e);
+    timeout(-1);
+    echo();
+    mvgetnstr(e->max_y - 1, strlen(e->message), out, size - 1);
+    noecho();
+    out[size - 1] = '\0';
+    move(e->max_y - 1, 0);
+    clrtoeol();
+    e->drawn_message[0] = '\0';
+}
+
+// Reads path into b, replacing its text. Returns 0, or the errno from
+// opening it, in which case the buffer is left empty and st zeroed. A large
+// file is mapped, unless it is followed: a followed log may be truncated,
+// and a mapping would then fault on the missing pages.
+int buffer_read(TextBuffer *b, const char *path, struct stat *st) {
+    buffer_free_text(b);
+    buffer_init(b);
+    memset(st, 0, sizeof(*st));
+    FILE *f = fopen(path, "r");
+    int error = f ? 0 : errno;
+    if (f && fstat(fileno(f), st) == 0 && st->st_size >= LARGE_FILE_SIZE && !b->following && buffer_map_file(b, path, st->st_size)) {
+        fclose(f);
+    } else if (f) {
+        size_t size = 0, capacity = 64 * 1024;
+        char *data = malloc(capacity);
+        size_t n;
+        while ((n = fread(data + size, 1, capacity - size, f)) > 0) {
+            size += n;
+            if (size == capacity) data = realloc(data, capacity *= 2);
+        }
+        fclose(f);
+        LineList list = {0};
+        const char *start = split_lines(data, data + size, &list, INT_MAX);
+        if (start < data + size) line_list_push(&list, start, data + size - start);
+        buffer_reserve(b, list.count);
+        for (int i = 0; i < list.count; i++) {
+            buffer_insert_line(b, i, list.lines[i].text, list.lines[i].len);
+        }
+        free(list.lines);
+        free(data);
+    }
+    if (buffer_loaded_lines(b) == 0) buffer_insert_line(b, 0, "", 0);
+    return error;
+}
+
+// Replays the journaled edits in [p, end) on b, stopping at the first
+// record that is cut short or does not fit the text. Returns the number
+// replayed and sets *used to the bytes they took.
+int journal_replay(TextBuffer *b, const char *p, const char *end, size_t *used) {
+    const char *start = p;
+    int count = 0;
+    *used = 0;
+    while (p < end) {
+        char type = *p++;
+        unsigned int y, x, len;
+        if ((type != '+' && type != '-') || !journal_get_varint(&p, end, &y) || !journal_get_varint(&p, end, &x) ||
+            !journal_get_varint(&p, end, &len) || len > (size_t)(end - p) || !buffer_has_line(b, y) || x > (unsigned int)buffer_line(b, y)->len) {
+            break;
+        }
+        int y1 = y, x1 = x, y2 = y, x2 = x;
+        if (type == '+') {
+            buffer_insert_string(b, &y2, &x2, p, len);
+        } else {
+            for (const char *c = p; c < p + len; c++) {
+                if (*c == '\n') {
+                    y2++;
+                    x2 = 0;
+                } else {
+                    x2++;
+                }
+            }
+            if (!buffer_has_line(b, y2) || x2 > buffer_line(b, y2)->len) break;
+            buffer_delete_range(b, y1, x1, y2, x2);
+        }
+        p += len;
+        *used = p - start;
+        count++;
+    }
+    return count;
+}
+
+// Offers to replay a journal left by a session that ended without closing
+// it. It applies if its base, the file or a checkpoint, is still the one
+// it was written against; otherwise, or if the offer is declined, it is
+// deleted. The journal goes on being appended to after a recovery.
+void journal_recover(Editor *e) {
+    TextBuffer *b = e->buf;
+    Journal *j = journal_new(b->filename, 0);
+    size_t size = 0, capacity = 64 * 1024;
+    char *data = malloc(capacity);
+    FILE *f = fopen(j->path, "rb");
+    size_t n;
+    while (f && (n = fread(data + size, 1, capacity - size, f)) > 0) {
+        size += n;
+        if (size == capacity) data = realloc(data, capacity *= 2);
+    }
+    if (f) fclose(f);
+    long long base[2];
+    if (size > JOURNAL_HEADER_SIZE) memcpy(base, data + 5, sizeof(base));
+    struct stat st;
+    bool current = size > JOURNAL_HEADER_SIZE && memcmp(data, JOURNAL_MAGIC, 4) == 0 &&
+                   (data[4] == JOURNAL_BASE_FILE ? base[0] == b->disk_size && base[1] == b->disk_mtime :
+                    data[4] == JOURNAL_BASE_CHECKPOINT && stat(j->base_path, &st) == 0 &&
+                    base[0] == st.st_size && base[1] == st.st_mtime);
+    char answer[8] = "";
+    if (current) {
+        char label[MAX_FILENAME_LEN + 64];
+        snprintf(label, sizeof(label), "Recover unsaved edits to %s? (y or n) ", b->filename);
+        read_prompt(e, label, answer, sizeof(answer));
+    }
+    if (answer[0] != 'y' && answer[0] != 'Y') {
+        unlink(j->path);
+        unlink(j->base_path);
+        journal_free(j);
+        free(data);
+        return;
+    }
+    if (data[4] == JOURNAL_BASE_CHECKPOINT) {
+        buffer_read(b, j->base_path, &st);
+        // The checkpoint is not what the file holds.
+        b->version++;
+    }
+    size_t used;
+    int count = journal_replay(b, data + JOURNAL_HEADER_SIZE, data + size, &used);
+    // Whatever follows a torn or bad record is lost; appends go after it.
+    j->length = JOURNAL_HEADER_SIZE + used;
+    j->checkpoint_at = j->length + JOURNAL_CHECKPOINT_BYTES;
+    if (j->length < size) truncate(j->path, j->length);
+    j->existing = true;
+    b->journal = j;
+    journals_add(j);
+    free(data);
+    snprintf(e->message, sizeof(e->message), "Recovered %d edit%s to %s", count, count == 1 ? "" : "s", b->filename);
+}
+
+// Reads the current buffer's file into it, replacing its text. A file that
+// does not exist yet gives an empty buffer. The undo log and journal are kept
+// if the file is the one they were last read from, which is how a dropped
+// buffer comes back; on the first read, a journal left behind is offered.
+void load_file(Editor *e) {
+    TextBuffer *b = e->buf;
+    const char *filename = b->filename;
+    b->loaded = true;
+    struct stat st;
+    int error = buffer_read(b, filename, &st);
+    bool opened = !error;
+    if (error == ENOENT) snprintf(e->message, sizeof(e->message), "New file %s", filename);
+    else if (error) snprintf(e->message, sizeof(e->message), "Error: Cannot open %s", filename);
+    if (st.st_mtime != b->disk_mtime || st.st_size != b->disk_size) {
+        undo_free(&b->undo);
+        if (b->journal) journal_rotate(b->journal, JOURNAL_BASE_FILE, &st, b->journal->length);
+    }
+    b->disk_mtime = st.st_mtime;
+    b->disk_size = st.st_size;
+    b->disk_ino = st.st_ino;
+    b->saved_version = b->version;
+    detect_language(e);
+    if (opened && b->index_job) snprintf(e->message, sizeof(e->message), "Loaded %s, indexing...", filename);
+    else if (opened) snprintf(e->message, sizeof(e->message), "Loaded %s (%d lines)", filename, buffer_loaded_lines(b));
+    // A bench replays its keys from a trace, which a prompt would eat.
+    if (!b->journal && !term.headless) journal_recover(e);
+}
+
+// Returns the buffer visiting filename, adding an unloaded one if there is
+// none. A NULL filename always adds a new empty buffer.
+int add_buffer(Editor *e, const char *filename) {
+    for (int i = 0; filename && i < e->num_buffers; i++) {
+        if (e->buffers[i]->filename && strcmp(e->buffers[i]->filename, filename) == 0) return i;
+    }
+    if (e->num_buffers == e->buffers_capacity) {
+        e->buffers_capacity = e->buffers_capacity ? e->buffers_capacity * 2 : 8;
+        e->buffers = realloc(e->buffers, e->buffers_capacity * sizeof(TextBuffer *));
+    }
+    TextBuffer *b = calloc(1, sizeof(TextBuffer));
+    buffer_init(b);
+    b->follow_watch = -1;
+    if (filename) {
+        b->filename = strdup(filename);
+    } else {
+        buffer_insert_line(b, 0, "", 0);
+        b->loaded = true;
+    }
+    e->buffers[e->num_buffers] = b;
+    return e->num_buffers++;
+}
+
+// Packs the buffers that have been hidden for pack_idle switches, then
+// keeps the loaded ones within memory_budget, starting with those shown
+// longest ago. A background buffer that matches its file is dropped, to be
+// read again when it is next shown; any other is packed. What was freed is
+// handed back to the system, since the pool slabs are scattered through the
+// heap.
+void reclaim_buffers(Editor *e) {
+    bool freed = false;
+    for (int i = 0; i < e->num_buffers && e->pack_idle; i++) {
+        TextBuffer *b = e->buffers[i];
+        if (b != e->buf && b->loaded && !b->compact && !b->save && e->buffer_clock - b->last_shown >= (unsigned long)e->pack_idle) {
+            buffer_pack(b);
+            b->compact = freed = true;
+        }
+    }
+    size_t total = 0;
+    for (int i = 0; i < e->num_buffers && e->memory_budget; i++) {
+        if (e->buffers[i]->loaded) total += buffer_memory(e->buffers[i]);
+    }
+    while (e->memory_budget && total > e->memory_budget) {
+        TextBuffer *cold = NULL;
+        for (int i = 0; i < e->num_buffers; i++) {
+            TextBuffer *b = e->buffers[i];
+            if (b == e->buf || !b->loaded || b->save || (b->compact && !buffer_matches_file(b))) continue;
+            if (!cold || b->last_shown < cold->last_shown) cold = b;
+        }
+        if (!cold) break;
+        total -= buffer_memory(cold);
+        if (buffer_matches_file(cold)) {
+            buffer_free_text(cold);
+            cold->loaded = false;
+        } else {
+            buffer_pack(cold);
+            cold->compact = true;
+            total += buffer_memory(cold);
+        }
+        freed = true;
+    }
+#ifdef __GLIBC__
+    if (freed) malloc_trim(0);
+#endif
+}
+
+// Shows buffer i, saving the cursor and view of the one shown now and
+// restoring its own. Its file is read here if it has not been yet.
+void show_buffer(Editor *e, int i) {
+    TextBuffer *b = e->buf;
+    if (b) {
+        b->cursor_x = e->cursor_x;
+        b->cursor_y = e->cursor_y;
+        b->top_line = e->top_line;
+        b->left_col = e->left_col;
+        b->mark_x = e->mark_x;
+        b->mark_y = e->mark_y;
+        b->mark_active = e->mark_active;
+        b->language = e->language;
+    }
+    e->current_buffer = i;
+    e->buf = b = e->buffers[i];
+    b->last_shown = ++e->buffer_clock;
+    b->compact = false;
+    e->cursor_x = b->cursor_x;
+    e->cursor_y = b->cursor_y;
+    e->top_line = b->top_line;
+    e->left_col = b->left_col;
+    e->mark_x = b->mark_x;
+    e->mark_y = b->mark_y;
+    e->mark_active = b->mark_active;
+    e->language = b->language;
+    // Cached matches are only told apart by line and version.
+    e->search_stamp++;
+    e->full_redraw = true;
+    if (b->loaded) {
+        snprintf(e->message, sizeof(e->message), "Buffer %d of %d: %s", i + 1, e->num_buffers, b->filename ? b->filename : "(new)");
+    } else {
+        load_file(e);
+        // The file may have changed since the buffer was dropped.
+        if (!buffer_has_line(b, e->cursor_y)) e->cursor_y = e->top_line = buffer_num_lines(b) - 1;
+        Line *line = buffer_line(b, e->cursor_y);
+        if (e->cursor_x > line->len) e->cursor_x = line->len;
+        if (e->mark_active && (!buffer_has_line(b, e->mark_y) || e->mark_x > buffer_line(b, e->mark_y)->len)) e->mark_active = false;
+    }
+    reclaim_buffers(e);
+}
+
+// Follow mode. A followed file is watched with inotify where there is one,
+// and stat-ed every FOLLOW_POLL_MS otherwise. Growth is read from disk_size
+// on and appended as lines, so each update costs only the new data. A file
+// that shrinks or is replaced by another, as when a log is rotated, is read
+// again from the start.
+void follow_watch(Editor *e, TextBuffer *b) {
+#ifdef __linux__
+    if (e->inotify_fd < 0) e->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (b->follow_watch >= 0) inotify_rm_watch(e->inotify_fd, b->follow_watch);
+    b->follow_watch = -1;
+    if (e->inotify_fd >= 0 && b->following) {
+        b->follow_watch = inotify_add_watch(e->inotify_fd, b->filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+#endif
+    b->follow_changed = true;
+}
+
+// Whether the first disk_size bytes of the file end partway through a line.
+// An empty file counts, since the buffer holds one empty line for it.
+bool follow_partial_line(TextBuffer *b) {
+    if (b->disk_size == 0) return true;
+    char last = '\n';
+    int fd = open(b->filename, O_RDONLY);
+    if (fd >= 0 && pread(fd, &last, 1, b->disk_size - 1) != 1) last = '\n';
+    if (fd >= 0) close(fd);
+    return last != '\n';
+}
+
+// Appends n bytes read from the end of the file. The first line joins the
+// last one in the buffer if the file did not end with a newline before.
+void follow_append(TextBuffer *b, const char *data, size_t n) {
+    LineList list = {0};
+    const char *start = split_lines(data, data + n, &list, INT_MAX);
+    if (start < data + n) line_list_push(&list, start, data + n - start);
+    int y = buffer_num_lines(b), i = 0;
+    if (b->follow_partial) {
+        Line *last = buffer_line(b, y - 1);
+        buffer_insert_text(b, y - 1, last->len, list.lines[0].text, list.lines[0].len);
+        i = 1;
+    }
+    buffer_reserve(b, list.count - i);
+    for (; i < list.count; i++) buffer_insert_line(b, y++, list.lines[i].text, list.lines[i].len);
+    b->follow_partial = data[n - 1] != '\n';
+    free(list.lines);
+}
+
+// Brings the current buffer up to date with its followed file. The cursor
+// stays on the last line if it was there, so the view keeps to the bottom.
+void follow_update(Editor *e) {
+    TextBuffer *b = e->buf;
+    // A save of our own replaces the file, which is not news until
+    // save_finish has taken in the new one and watches it again.
+    if (b->save) return;
+    b->follow_changed = false;
+    struct stat st;
+    // A rotated log may not have been created again yet.
+    if (b->index_job || stat(b->filename, &st) != 0) return;
+    bool pinned = e->cursor_y >= buffer_num_lines(b) - 1;
+    if (st.st_ino != b->disk_ino || st.st_size < b->disk_size) {
+        if (b->version != b->saved_version) {
+            b->following = false;
+            follow_watch(e, b);
+            snprintf(e->message, sizeof(e->message), "Stopped following %s: it was replaced or truncated", b->filename);
+            return;
+        }
+        load_file(e);
+        follow_watch(e, b);
+        b->follow_partial = follow_partial_line(b);
+        if (pinned || !buffer_has_line(b, e->cursor_y)) e->cursor_y = buffer_num_lines(b) - 1;
+        Line *line = buffer_line(b, e->cursor_y);
+        if (e->cursor_x > line->len) e->cursor_x = line->len;
+        e->mark_active = false;
+        snprintf(e->message, sizeof(e->message), "Following %s: read again from the start", b->filename);
+        return;
+    }
+    if (st.st_size == b->disk_size) return;
+    int fd = open(b->filename, O_RDONLY);
+    if (fd < 0) return;
+    bool clean = b->version == b->saved_version;
+    int last = buffer_num_lines(b) - 1;
+    static char chunk[FOLLOW_READ_SIZE];
+    ssize_t n;
+    while (b->disk_size < st.st_size && (n = pread(fd, chunk, sizeof(chunk), b->disk_size)) > 0) {
+        follow_append(b, chunk, n);
+        b->disk_size += n;
+    }
+    close(fd);
+    b->disk_mtime = st.st_mtime;
+    if (clean) b->saved_version = b->version;
+    if (pinned && buffer_num_lines(b) - 1 > last) {
+        e->cursor_y = buffer_num_lines(b) - 1;
+        e->cursor_x = 0;
+    }
+}
+
+// Takes in the changes inotify has seen, then updates the current buffer
+// if it is followed and its file may have changed.
+void follow_poll(Editor *e) {
+#ifdef __linux__
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while (e->inotify_fd >= 0 && (n = read(e->inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            for (int i = 0; i < e->num_buffers; i++) {
+                TextBuffer *b = e->buffers[i];
+                if (b->follow_watch != ev->wd) continue;
+                b->follow_changed = true;
+                // The watch went with the old file; watch whatever is at
+                // the path now, or poll until something is.
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) follow_watch(e, b);
+            }
+        }
+    }
+#endif
+    TextBuffer *b = e->buf;
+    if (!b->following) return;
+    if (b->follow_watch < 0) follow_watch(e, b);
+    if (b->follow_changed) follow_update(e);
+}
+
+void toggle_follow(Editor *e) {
+    TextBuffer *b = e->buf;
+    if (!b->filename) {
+        snprintf(e->message, sizeof(e->message), "Nothing to follow: the buffer has no file");
+        return;
+    }
+    if (!b->following && b->map && b->save) {
+        snprintf(e->message, sizeof(e->message), "Still saving %s", b->filename);
+        return;
+    }
+    b->following = !b->following;
+    follow_watch(e, b);
+    if (!b->following) {
+        snprintf(e->message, sizeof(e->message), "Stopped following %s", b->filename);
+        return;
+    }
+    buffer_unmap(b);
+    b->follow_partial = follow_partial_line(b);
+    e->cursor_y = buffer_num_lines(b) - 1;
+    e->cursor_x = 0;
+    snprintf(e->message, sizeof(e->message), "Following %s", b->filename);
+    follow_update(e);
+}
+
+void save_file(Editor *e) {
+    TextBuffer *b = e->buf;
+    if (!b->filename) {
+        char filename[MAX_FILENAME_LEN];
+        read_prompt(e, "Enter filename to save: ", filename, MAX_FILENAME_LEN);
+        if (filename[0] == '\0' || strchr(filename, '\n')) {
+            snprintf(e->message, sizeof(e->message), "Invalid filename");
+            return;
+        }
+        e->buf->filename = strdup(filename);
+        detect_language(e);
+    }
+    if (b->save && b->save->checkpoint) {
+        b->save_pending = true;
+    } else if (b->save) {
+        snprintf(e->message, sizeof(e->message), "Still saving %s", b->filename);
+        return;
+    } else {
+        save_start(e, b, b->filename, false);
+    }
+    snprintf(e->message, sizeof(e->message), "Saving %s...", b->filename);
+}
+
+// Writes a snapshot of b to path on a worker thread; save_finish ends it.
+// A checkpoint writes the journal's base instead of the file.
+void save_start(Editor *e, TextBuffer *b, const char *path, bool checkpoint) {
+    SaveJob *job = calloc(1, sizeof(SaveJob));
+    char *real = realpath(path, NULL);
+    job->path = real ? real : strdup(path);
+    struct stat st;
+    if (checkpoint) {
+        job->mode = 0600;
+    } else if (stat(job->path, &st) == 0) {
+        job->mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        job->mode = 0666 & ~mask;
+    }
+    // The snapshot shares the line texts instead of copying them; holding
+    // them makes the next change to each line copy it first.
+    job->count = buffer_num_lines(b);
+    job->lines = malloc(job->count * sizeof(Line));
+    for (int y = 0; y < job->count; y++) {
+        Line *l = buffer_line(b, y);
+        if (l->cap > 0) {
+            l->held_cap = l->cap;
+            l->cap = 0;
+        }
+        job->lines[y] = *l;
+        job->total += l->len + 1;
+    }
+    job->map = b->map;
+    job->map_size = b->map_size;
+    job->version = b->version;
+    job->checkpoint = checkpoint;
+    job->journal_keep = b->journal ? b->journal->length : JOURNAL_HEADER_SIZE;
+    job->start_ns = now_ns();
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+    b->save = job;
+    e->saving++;
+    workers_submit(save_job_run, job);
+}
+
+// Ends a save whose writer is done. The held texts that the buffer still
+// uses are handed back to it, and the ones it has replaced since are freed.
+// The journal starts over from what was written, keeping only the edits
+// made since the snapshot.
+void save_finish(Editor *e, TextBuffer *b) {
+    SaveJob *job = b->save;
+    int count = buffer_loaded_lines(b);
+    for (int y = 0; y < count; y++) {
+        Line *l = buffer_slot(b, y);
+        if (l->held_cap) {
+            l->cap = l->held_cap;
+            l->held_cap = 0;
+        }
+    }
+    pool_release_held(&b->pool);
+    Journal *j = b->journal;
+    if (job->checkpoint && job->error) {
+        j->checkpoint_at = j->length + JOURNAL_CHECKPOINT_BYTES;
+    } else if (job->checkpoint) {
+        journal_rotate(j, JOURNAL_BASE_CHECKPOINT, &job->st, job->journal_keep);
+    } else if (job->error) {
+        snprintf(e->message, sizeof(e->message), "Error: Cannot save %s: %s", b->filename, strerror(job->error));
+    } else {
+        b->disk_mtime = job->st.st_mtime;
+        b->disk_size = job->st.st_size;
+        b->disk_ino = job->st.st_ino;
+        b->saved_version = job->version;
+        // The save replaced the file, and always ends it with a newline.
+        b->follow_partial = false;
+        if (j) journal_rotate(j, JOURNAL_BASE_FILE, &job->st, job->journal_keep);
+        double seconds = (job->end_ns - job->start_ns) / 1e9;
+        snprintf(e->message, sizeof(e->message), "Saved %s (%.1f MB in %.2f s, %.0f MB/s)", b->filename,
+                 job->total / 1048576.0, seconds, seconds > 0 ? job->total / 1048576.0 / seconds : 0);
+    }
+    // The save replaced the file, taking the watch with the old one, and
+    // any change it set off is checked now that disk_ino is current.
+    if (!job->checkpoint && b->following) follow_watch(e, b);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->finished);
+    free(job->path);
+    free(job->lines);
+    free(job);
+    b->save = NULL;
+    e->saving--;
+    if (b->save_pending) {
+        b->save_pending = false;
+        save_start(e, b, b->filename, false);
+    }
+}
 
-            if (is_keyword) {
-                attron(COLOR_PAIR(COLOR_KEYWORD));
-                for (int k = 0; k < j; k++) {
-                    mvaddch(y, i - j + k + 6, word[k]);
-                }
-                attroff(COLOR_PAIR(COLOR_KEYWORD));
-            } else {
-                for (int k = 0; k < j; k++) {
-                    mvaddch(y, i - j + k + 6, word[k]);
-                }
-            }
-            continue;
+// Checkpoints each buffer whose journal has grown by
+// JOURNAL_CHECKPOINT_BYTES, so there is never much to replay.
+void checkpoint_journals(Editor *e) {
+    for (int i = 0; i < e->num_buffers; i++) {
+        TextBuffer *b = e->buffers[i];
+        if (b->journal && !b->save && !b->compact && b->journal->length >= b->journal->checkpoint_at) {
+            save_start(e, b, b->journal->base_path, true);
         }
+    }
+}
 
-        mvaddch(y, i + 6, line[i]);
-        i++;
+// Drops the records that could have been redone; a new edit replaces them.
+void undo_truncate(UndoLog *u) {
+    if (u->pos == u->count) return;
+    u->text_len = u->records[u->pos].text;
+    for (int i = u->pos; i < u->count; i++) {
+        if (u->records[i].chunk) chunk_unref(u->records[i].chunk);
     }
+    u->count = u->pos;
+}
 
-    e->in_multiline_comment = in_comment;
+void undo_reserve_text(UndoLog *u, size_t n) {
+    if (u->text_len + n <= u->text_cap) return;
+    u->text_cap = (u->text_len + n) * 2;
+    u->text = realloc(u->text, u->text_cap);
 }
 
-void draw(Editor *e) {
-    clear();
-    int display_lines = e->max_y - 1;
-    if (e->top_line < 0) e->top_line = 0;
-    if (e->top_line > e->num_lines - 1) e->top_line = e->num_lines - 1;
-    for (int i = 0; i < display_lines && i + e->top_line < e->num_lines; i++) {
-        int line_num = i + e->top_line + 1;
-        mvprintw(i, 0, "%4d: ", line_num);
-        highlight_line(e, e->lines[i + e->top_line], i);
-    }
-    mvprintw(e->max_y - 1, 0, "%.*s", e->max_x - 1, e->message);
-    if (e->cursor_y >= e->top_line && e->cursor_y < e->top_line + display_lines) {
-        move(e->cursor_y - e->top_line, e->cursor_x + 6);
-    } else {
-        if (e->cursor_y < e->top_line) e->top_line = e->cursor_y;
-        if (e->cursor_y >= e->top_line + display_lines) e->top_line = e->cursor_y - display_lines + 1;
-        move(e->cursor_y - e->top_line, e->cursor_x + 6);
+UndoRecord *undo_push(UndoLog *u, UndoType type, int y, int x, int len, bool chained) {
+    undo_truncate(u);
+    if (u->count == u->capacity) {
+        u->capacity = u->capacity ? u->capacity * 2 : 256;
+        u->records = realloc(u->records, u->capacity * sizeof(UndoRecord));
     }
-    refresh();
+    u->records[u->count] = (UndoRecord){ type, chained, y, x, len, u->text_len, NULL };
+    u->pos = ++u->count;
+    u->sealed = true;
+    return &u->records[u->count - 1];
 }
 
-void load_file(Editor *e, const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        snprintf(e->message, sizeof(e->message), "Error: Cannot open %s", filename);
-        return;
-    }
-    int buf = e->current_buffer;
-    for (int i = 0; i < e->num_lines_buf[buf]; i++) free(e->buffers[buf][i]);
-    e->num_lines_buf[buf] = 0;
-    char line[MAX_LINE_LEN];
-    while (fgets(line, MAX_LINE_LEN, f) && e->num_lines_buf[buf] < MAX_LINES) {
-        line[strcspn(line, "\n")] = '\0';
-        e->buffers[buf][e->num_lines_buf[buf]] = STRDUP(line);
-        e->num_lines_buf[buf]++;
-    }
-    fclose(f);
-    if (e->num_lines_buf[buf] == 0) {
-        e->buffers[buf][0] = STRDUP("");
-        e->num_lines_buf[buf] = 1;
-    }
-    e->filenames[buf] = strdup(filename);
-    e->lines = e->buffers[buf];
-    e->num_lines = e->num_lines_buf[buf];
-    e->filename = e->filenames[buf];
-    e->cursor_x = e->cursor_y = e->top_line = 0;
-    detect_language(e);
-    snprintf(e->message, sizeof(e->message), "Loaded %s", filename);
+// Records an edit to b as a record of its own, copying text into the arena.
+// Every edit is journaled here or in one of the two functions below.
+void undo_record(TextBuffer *b, UndoType type, int y, int x, const char *text, int len, bool chained) {
+    UndoLog *u = &b->undo;
+    journal_record(b, type, y, x, text, len);
+    undo_push(u, type, y, x, len, chained);
+    undo_reserve_text(u, len);
+    memcpy(u->text + u->text_len, text, len);
+    u->text_len += len;
 }
 
-void save_file(Editor *e) {
-    if (!e->filename) {
-        snprintf(e->message, sizeof(e->message), "Enter filename to save: ");
-        draw(e);
-        echo();
-        char filename[MAX_FILENAME_LEN];
-        mvgetnstr(e->max_y - 1, strlen(e->message), filename, MAX_FILENAME_LEN - 1);
-        noecho();
-        filename[MAX_FILENAME_LEN - 1] = '\0';
-        if (filename[0] == '\0' || strchr(filename, '\n')) {
-            snprintf(e->message, sizeof(e->message), "Invalid filename");
+// Records an edit to b whose text is held by chunk, taking a reference.
+void undo_record_chunk(TextBuffer *b, UndoType type, int y, int x, TextChunk *chunk, bool chained) {
+    journal_record(b, type, y, x, chunk->text, chunk->len);
+    undo_push(&b->undo, type, y, x, chunk->len, chained)->chunk = chunk_ref(chunk);
+}
+
+// Records a single character typed or deleted at y, x. If it continues the
+// run in the last record, the record grows instead, so typing is undone a
+// word at a time and Backspace or Delete held down a stretch at a time.
+void undo_record_char(TextBuffer *b, UndoType type, int y, int x, char c) {
+    UndoLog *u = &b->undo;
+    journal_record(b, type, y, x, &c, 1);
+    undo_truncate(u);
+    UndoRecord *r = u->count ? &u->records[u->count - 1] : NULL;
+    if (r && !u->sealed && r->type == type && r->y == y && r->len < UNDO_RUN_MAX) {
+        char last = u->text[r->text + r->len - 1];
+        if (type == UNDO_INSERT && x == r->x + r->len && !(ISSPACE(last) && !ISSPACE(c))) {
+            undo_reserve_text(u, 1);
+            u->text[u->text_len++] = c;
+            r->len++;
+            return;
+        }
+        if (type == UNDO_DELETE && (x == r->x || x + 1 == r->x)) {
+            undo_reserve_text(u, 1);
+            if (x == r->x) {
+                u->text[u->text_len] = c;
+            } else {
+                memmove(u->text + r->text + 1, u->text + r->text, r->len);
+                u->text[r->text] = c;
+                r->x = x;
+            }
+            u->text_len++;
+            r->len++;
             return;
         }
-        e->filenames[e->current_buffer] = strdup(filename);
-        e->filename = e->filenames[e->current_buffer];
-        detect_language(e);
-    }
-    FILE *f = fopen(e->filename, "w");
-    if (!f) {
-        snprintf(e->message, sizeof(e->message), "Error: Cannot save %s", e->filename);
-        return;
-    }
-    for (int i = 0; i < e->num_lines; i++) {
-        fprintf(f, "%s\n", e->lines[i]);
     }
-    fclose(f);
-    snprintf(e->message, sizeof(e->message), "Saved %s", e->filename);
+    undo_push(u, type, y, x, 1, false);
+    undo_reserve_text(u, 1);
+    u->text[u->text_len++] = c;
+    u->sealed = false;
 }
 
-void add_undo(Editor *e, const char *action, int x, int y, char data, char *bulk_data, int line_count) {
-    if (e->undo_count >= e->undo_size) return;
-    e->undo_stack[e->undo_count].action = strdup(action);
-    e->undo_stack[e->undo_count].x = x;
-    e->undo_stack[e->undo_count].y = y;
-    e->undo_stack[e->undo_count].data = data;
-    e->undo_stack[e->undo_count].bulk_data = bulk_data ? STRDUP(bulk_data) : NULL;
-    e->undo_stack[e->undo_count].line_count = line_count;
-    e->undo_count++;
+// Applies r to the buffer, or its inverse when undoing, and moves the cursor
+// to where the change happened: the start of it for undo, the end for redo.
+void undo_apply(Editor *e, UndoRecord *r, bool undoing) {
+    const char *text = r->chunk ? r->chunk->text : e->buf->undo.text + r->text;
+    int y = r->y, x = r->x;
+    bool inserting = (r->type == UNDO_INSERT) != undoing;
+    journal_record(e->buf, inserting ? UNDO_INSERT : UNDO_DELETE, r->y, r->x, text, r->len);
+    if (inserting) {
+        if (r->chunk) buffer_insert_chunk(e->buf, &y, &x, r->chunk);
+        else buffer_insert_string(e->buf, &y, &x, text, r->len);
+    } else {
+        for (const char *p = text; p < text + r->len; p++) {
+            if (*p == '\n') {
+                y++;
+                x = 0;
+            } else {
+                x++;
+            }
+        }
+        buffer_delete_range(e->buf, r->y, r->x, y, x);
+        y = r->y;
+        x = r->x;
+    }
+    e->cursor_y = undoing ? r->y : y;
+    e->cursor_x = undoing ? r->x : x;
 }
 
 void undo(Editor *e) {
-    if (e->undo_count == 0) {
+    UndoLog *u = &e->buf->undo;
+    if (u->pos == 0) {
         snprintf(e->message, sizeof(e->message), "Nothing to undo");
         return;
     }
-    e->undo_count--;
-    char *action = e->undo_stack[e->undo_count].action;
-    int x = e->undo_stack[e->undo_count].x, y = e->undo_stack[e->undo_count].y;
-    char data = e->undo_stack[e->undo_count].data;
-    if (strcmp(action, "insert") == 0) {
-        char *line = e->lines[y];
-        memmove(line + x, line + x + 1, (STRLEN(line + x) + 1) * sizeof(char));
-        e->cursor_x = x;
-        e->cursor_y = y;
-    } else if (strcmp(action, "delete") == 0 || strcmp(action, "delete_right") == 0) {
-        char *line = e->lines[y];
-        char *new_line = malloc((STRLEN(line) + 2) * sizeof(char));
-        STRNCPY(new_line, line, x);
-        new_line[x] = data;
-        STRCPY(new_line + x + 1, line + x);
-        free(line);
-        e->lines[y] = new_line;
-        e->cursor_x = x;
-        e->cursor_y = y;
-    } else if (strcmp(action, "newline") == 0) {
-        char *line = e->lines[y];
-        char *next_line = e->lines[y + 1];
-        char *new_line = malloc((STRLEN(line) + STRLEN(next_line) + 1) * sizeof(char));
-        STRCPY(new_line, line);
-        STRCAT(new_line, next_line);
-        free(line);
-        free(next_line);
-        e->lines[y] = new_line;
-        memmove(&e->lines[y + 1], &e->lines[y + 2], (e->num_lines - y - 2) * sizeof(char *));
-        e->num_lines--;
-        e->cursor_x = x;
-        e->cursor_y = y;
-    } else if (strcmp(action, "bulk_insert") == 0 || strcmp(action, "delete_word") == 0) {
-        int line_count = e->undo_stack[e->undo_count].line_count;
-        for (int i = 0; i < line_count; i++) {
-            free(e->lines[y + i]);
-        }
-        memmove(&e->lines[y], &e->lines[y + line_count], (e->num_lines - y - line_count) * sizeof(char *));
-        e->num_lines -= line_count;
-        e->cursor_x = x;
-        e->cursor_y = y;
-        free(e->undo_stack[e->undo_count].bulk_data);
-        e->undo_stack[e->undo_count].bulk_data = NULL;
-    }
-    free(action);
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
+    UndoRecord *r;
+    do {
+        r = &u->records[--u->pos];
+        undo_apply(e, r, true);
+    } while (r->chained && u->pos > 0);
+    u->sealed = true;
     snprintf(e->message, sizeof(e->message), "Undo performed");
-    draw(e);
 }
 
-void insert_char(Editor *e, char c, bool redraw) {
+void redo(Editor *e) {
+    UndoLog *u = &e->buf->undo;
+    if (u->pos == u->count) {
+        snprintf(e->message, sizeof(e->message), "Nothing to redo");
+        return;
+    }
+    do {
+        undo_apply(e, &u->records[u->pos++], false);
+    } while (u->pos < u->count && u->records[u->pos].chained);
+    u->sealed = true;
+    snprintf(e->message, sizeof(e->message), "Redo performed");
+}
+
+void insert_char(Editor *e, char c) {
     if (!ISPRINT(c)) return;
-    char *line = e->lines[e->cursor_y];
-    if (STRLEN(line) >= MAX_LINE_LEN - 1) return;
-    add_undo(e, "insert", e->cursor_x, e->cursor_y, c, NULL, 0);
-    char *new_line = malloc((STRLEN(line) + 2) * sizeof(char));
-    STRNCPY(new_line, line, e->cursor_x);
-    new_line[e->cursor_x] = c;
-    STRCPY(new_line + e->cursor_x + 1, line + e->cursor_x);
-    free(line);
-    e->lines[e->cursor_y] = new_line;
+    undo_record_char(e->buf, UNDO_INSERT, e->cursor_y, e->cursor_x, c);
+    buffer_insert_text(e->buf, e->cursor_y, e->cursor_x, &c, 1);
     e->cursor_x++;
-    if (redraw) draw(e);
 }
 
 void delete_char(Editor *e) {
-    char *line = e->lines[e->cursor_y];
+    Line *line = buffer_line(e->buf, e->cursor_y);
     if (e->cursor_x == 0 && e->cursor_y == 0) return;
     if (e->cursor_x > 0) {
-        add_undo(e, "delete", e->cursor_x - 1, e->cursor_y, line[e->cursor_x - 1], NULL, 0);
-        memmove(line + e->cursor_x - 1, line + e->cursor_x, (STRLEN(line + e->cursor_x) + 1) * sizeof(char));
+        undo_record_char(e->buf, UNDO_DELETE, e->cursor_y, e->cursor_x - 1, line->text[e->cursor_x - 1]);
+        buffer_delete_text(e->buf, e->cursor_y, e->cursor_x - 1, 1);
         e->cursor_x--;
     } else if (e->cursor_y > 0) {
-        char *prev_line = e->lines[e->cursor_y - 1];
-        e->cursor_x = STRLEN(prev_line);
-        char *new_line = malloc((STRLEN(prev_line) + STRLEN(line) + 1) * sizeof(char));
-        STRCPY(new_line, prev_line);
-        STRCAT(new_line, line);
-        free(prev_line);
-        free(line);
-        e->lines[e->cursor_y - 1] = new_line;
-        memmove(&e->lines[e->cursor_y], &e->lines[e->cursor_y + 1], (e->num_lines - e->cursor_y - 1) * sizeof(char *));
-        e->num_lines--;
+        e->cursor_x = buffer_line(e->buf, e->cursor_y - 1)->len;
+        undo_record(e->buf, UNDO_DELETE, e->cursor_y - 1, e->cursor_x, "\n", 1, false);
+        buffer_join_lines(e->buf, e->cursor_y - 1);
         e->cursor_y--;
     }
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
-    draw(e);
 }
 
 void delete_char_right(Editor *e) {
-    char *line = e->lines[e->cursor_y];
-    if (e->cursor_x < STRLEN(line)) {
-        add_undo(e, "delete_right", e->cursor_x, e->cursor_y, line[e->cursor_x], NULL, 0);
-        memmove(line + e->cursor_x, line + e->cursor_x + 1, (STRLEN(line + e->cursor_x + 1) + 1) * sizeof(char));
-    } else if (e->cursor_y < e->num_lines - 1) {
-        char *next_line = e->lines[e->cursor_y + 1];
-        char *new_line = malloc((STRLEN(line) + STRLEN(next_line) + 1) * sizeof(char));
-        STRCPY(new_line, line);
-        STRCAT(new_line, next_line);
-        free(line);
-        free(next_line);
-        e->lines[e->cursor_y] = new_line;
-        memmove(&e->lines[e->cursor_y + 1], &e->lines[e->cursor_y + 2], (e->num_lines - e->cursor_y - 2) * sizeof(char *));
-        e->num_lines--;
+    Line *line = buffer_line(e->buf, e->cursor_y);
+    if (e->cursor_x < line->len) {
+        undo_record_char(e->buf, UNDO_DELETE, e->cursor_y, e->cursor_x, line->text[e->cursor_x]);
+        buffer_delete_text(e->buf, e->cursor_y, e->cursor_x, 1);
+    } else if (buffer_has_line(e->buf, e->cursor_y + 1)) {
+        undo_record(e->buf, UNDO_DELETE, e->cursor_y, e->cursor_x, "\n", 1, false);
+        buffer_join_lines(e->buf, e->cursor_y);
     } else {
         return;
     }
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
-    draw(e);
 }
 
 void delete_word_left(Editor *e) {
     int orig_x = e->cursor_x, orig_y = e->cursor_y;
-    char *line = e->lines[e->cursor_y];
     if (e->cursor_x == 0 && e->cursor_y == 0) return;
 
+    Line *line = buffer_line(e->buf, e->cursor_y);
     int new_x = e->cursor_x, new_y = e->cursor_y;
-    while (new_x > 0 && ISSPACE(line[new_x - 1])) new_x--;
-    while (new_x > 0 && !ISALNUM(line[new_x - 1]) && !ISSPACE(line[new_x - 1])) new_x--;
-    while (new_x > 0 && ISALNUM(line[new_x - 1])) new_x--;
+    while (new_x > 0 && ISSPACE(line->text[new_x - 1])) new_x--;
+    while (new_x > 0 && !ISALNUM(line->text[new_x - 1]) && !ISSPACE(line->text[new_x - 1])) new_x--;
+    while (new_x > 0 && ISALNUM(line->text[new_x - 1])) new_x--;
     if (new_x == 0 && new_y > 0) {
         new_y--;
-        line = e->lines[new_y];
-        new_x = STRLEN(line);
-        while (new_x > 0 && ISSPACE(line[new_x - 1])) new_x--;
-        while (new_x > 0 && !ISALNUM(line[new_x - 1]) && !ISSPACE(line[new_x - 1])) new_x--;
-    }
-
-    char *deleted = NULL;
-    int deleted_len = 0;
-    if (new_y == orig_y) {
-        deleted_len = orig_x - new_x;
-        deleted = STRNDUP(line + new_x, deleted_len);
-    } else {
-        deleted_len = STRLEN(e->lines[new_y]) - new_x + 1 + orig_x;
-        deleted = malloc(deleted_len + 1);
-        deleted[0] = '\0';
-        STRCAT(deleted, e->lines[new_y] + new_x);
-        STRCAT(deleted, NEWLINE);
-        STRCAT(deleted, e->lines[orig_y]);
+        line = buffer_line(e->buf, new_y);
+        new_x = line->len;
+        while (new_x > 0 && ISSPACE(line->text[new_x - 1])) new_x--;
+        while (new_x > 0 && !ISALNUM(line->text[new_x - 1]) && !ISSPACE(line->text[new_x - 1])) new_x--;
     }
 
-    if (new_y == orig_y) {
-        memmove(line + new_x, line + orig_x, (STRLEN(line + orig_x) + 1) * sizeof(char));
-        e->cursor_x = new_x;
-    } else {
-        char *new_line = malloc((new_x + STRLEN(e->lines[orig_y]) + 1) * sizeof(char));
-        STRNCPY(new_line, e->lines[new_y], new_x);
-        new_line[new_x] = '\0';
-        STRCAT(new_line, e->lines[orig_y]);
-        free(e->lines[new_y]);
-        e->lines[new_y] = new_line;
-        memmove(&e->lines[new_y + 1], &e->lines[orig_y], (e->num_lines - orig_y) * sizeof(char *));
-        e->num_lines -= (orig_y - new_y);
-        e->cursor_y = new_y;
-        e->cursor_x = new_x;
-    }
-
-    add_undo(e, "delete_word", e->cursor_x, e->cursor_y, '\0', deleted, orig_y - new_y + 1);
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
-    draw(e);
+    TextChunk *deleted = buffer_copy_range(e->buf, new_y, new_x, orig_y, orig_x);
+    undo_record_chunk(e->buf, UNDO_DELETE, new_y, new_x, deleted, false);
+    chunk_unref(deleted);
+    buffer_delete_range(e->buf, new_y, new_x, orig_y, orig_x);
+    e->cursor_y = new_y;
+    e->cursor_x = new_x;
 }
 
 void delete_word_right(Editor *e) {
     int orig_x = e->cursor_x, orig_y = e->cursor_y;
-    char *line = e->lines[e->cursor_y];
-    if (e->cursor_y == e->num_lines - 1 && e->cursor_x == STRLEN(line)) return;
+    Line *line = buffer_line(e->buf, e->cursor_y);
+    if (e->cursor_x == line->len && !buffer_has_line(e->buf, e->cursor_y + 1)) return;
 
     int new_x = e->cursor_x, new_y = e->cursor_y;
-    while (line[new_x] && ISALNUM(line[new_x])) new_x++;
-    while (line[new_x] && !ISALNUM(line[new_x]) && !ISSPACE(line[new_x])) new_x++;
-    while (line[new_x] && ISSPACE(line[new_x])) new_x++;
-    if (!line[new_x] && new_y < e->num_lines - 1) {
+    while (new_x < line->len && ISALNUM(line->text[new_x])) new_x++;
+    while (new_x < line->len && !ISALNUM(line->text[new_x]) && !ISSPACE(line->text[new_x])) new_x++;
+    while (new_x < line->len && ISSPACE(line->text[new_x])) new_x++;
+    if (new_x == line->len && buffer_has_line(e->buf, new_y + 1)) {
         new_y++;
         new_x = 0;
-        line = e->lines[new_y];
-    }
-
-    char *deleted = NULL;
-    int deleted_len = 0;
-    if (new_y == orig_y) {
-        deleted_len = new_x - orig_x;
-        deleted = STRNDUP(line + orig_x, deleted_len);
-    } else {
-        deleted_len = STRLEN(line) - orig_x + 1 + STRLEN(e->lines[new_y]);
-        deleted = malloc(deleted_len + 1);
-        deleted[0] = '\0';
-        STRCAT(deleted, line + orig_x);
-        STRCAT(deleted, NEWLINE);
-        STRCAT(deleted, e->lines[new_y]);
     }
 
-    if (new_y == orig_y) {
-        memmove(line + orig_x, line + new_x, (STRLEN(line + new_x) + 1) * sizeof(char));
-    } else {
-        char *new_line = malloc((orig_x + STRLEN(e->lines[new_y]) + 1) * sizeof(char));
-        STRNCPY(new_line, line, orig_x);
-        new_line[orig_x] = '\0';
-        STRCAT(new_line, e->lines[new_y]);
-        free(e->lines[orig_y]);
-        e->lines[orig_y] = new_line;
-        memmove(&e->lines[orig_y + 1], &e->lines[new_y + 1], (e->num_lines - new_y - 1) * sizeof(char *));
-        e->num_lines -= (new_y - orig_y);
-    }
-
-    add_undo(e, "delete_word", e->cursor_x, e->cursor_y, '\0', deleted, new_y - orig_y + 1);
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
-    draw(e);
+    TextChunk *deleted = buffer_copy_range(e->buf, orig_y, orig_x, new_y, new_x);
+    undo_record_chunk(e->buf, UNDO_DELETE, orig_y, orig_x, deleted, false);
+    chunk_unref(deleted);
+    buffer_delete_range(e->buf, orig_y, orig_x, new_y, new_x);
 }
 
-void insert_newline(Editor *e, bool redraw) {
-    if (e->num_lines >= MAX_LINES) return;
-    add_undo(e, "newline", e->cursor_x, e->cursor_y, '\0', NULL, 0);
-    char *line = e->lines[e->cursor_y];
-    char *new_line = malloc(MAX_LINE_LEN * sizeof(char));
-    STRCPY(new_line, line + e->cursor_x);
-    line[e->cursor_x] = '\0';
-    memmove(&e->lines[e->cursor_y + 2], &e->lines[e->cursor_y + 1], (e->num_lines - e->cursor_y - 1) * sizeof(char *));
-    e->lines[e->cursor_y + 1] = new_line;
-    e->num_lines++;
+void insert_newline(Editor *e) {
+    undo_record(e->buf, UNDO_INSERT, e->cursor_y, e->cursor_x, "\n", 1, false);
+    buffer_split_line(e->buf, e->cursor_y, e->cursor_x);
     e->cursor_y++;
     e->cursor_x = 0;
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
-    if (redraw) draw(e);
-}
-
-void insert_lines(Editor *e, char **new_lines, int line_count, bool redraw) {
-    if (e->num_lines + line_count > MAX_LINES) return;
-    char *bulk_data = malloc(MAX_LINE_LEN * line_count * sizeof(char));
-    bulk_data[0] = '\0';
-    for (int i = 0; i < line_count; i++) {
-        STRCAT(bulk_data, new_lines[i]);
-        if (i < line_count - 1) STRCAT(bulk_data, NEWLINE);
-    }
-    add_undo(e, "bulk_insert", e->cursor_x, e->cursor_y, '\0', bulk_data, line_count);
-    char *line = e->lines[e->cursor_y];
-    char *line_tail = malloc(MAX_LINE_LEN * sizeof(char));
-    STRCPY(line_tail, line + e->cursor_x);
-    line[e->cursor_x] = '\0';
-    memmove(&e->lines[e->cursor_y + line_count + 1], &e->lines[e->cursor_y + 1], (e->num_lines - e->cursor_y - 1) * sizeof(char *));
-    for (int i = 0; i < line_count; i++) {
-        e->lines[e->cursor_y + i] = STRDUP(new_lines[i]);
-    }
-    e->lines[e->cursor_y + line_count] = line_tail;
-    e->num_lines += line_count;
-    e->cursor_y += line_count - 1;
-    e->cursor_x = STRLEN(new_lines[line_count - 1]);
-    if (line_count == 1 && e->cursor_x == 0) {
-        e->cursor_y++;
-        e->cursor_x = 0;
-    }
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
-    if (redraw) draw(e);
 }
 
 void move_cursor_up(Editor *e) {
     if (e->cursor_y > 0) {
         e->cursor_y--;
-        e->cursor_x = e->cursor_x < STRLEN(e->lines[e->cursor_y]) ? e->cursor_x : STRLEN(e->lines[e->cursor_y]);
+        int len = buffer_line(e->buf, e->cursor_y)->len;
+        e->cursor_x = e->cursor_x < len ? e->cursor_x : len;
         if (e->cursor_y < e->top_line) e->top_line = e->cursor_y;
     }
-    draw(e);
 }
 
 void move_cursor_down(Editor *e) {
-    if (e->cursor_y < e->num_lines - 1) {
+    if (buffer_has_line(e->buf, e->cursor_y + 1)) {
         e->cursor_y++;
-        e->cursor_x = e->cursor_x < STRLEN(e->lines[e->cursor_y]) ? e->cursor_x : STRLEN(e->lines[e->cursor_y]);
+        int len = buffer_line(e->buf, e->cursor_y)->len;
+        e->cursor_x = e->cursor_x < len ? e->cursor_x : len;
         if (e->cursor_y >= e->top_line + e->max_y - 1) e->top_line = e->cursor_y - e->max_y + 2;
     }
-    draw(e);
 }
 
 void move_cursor_left(Editor *e) {
     if (e->cursor_x > 0) e->cursor_x--;
-    draw(e);
 }
 
 void move_cursor_right(Editor *e) {
-    if (e->cursor_x < STRLEN(e->lines[e->cursor_y])) e->cursor_x++;
-    draw(e);
+    if (e->cursor_x < buffer_line(e->buf, e->cursor_y)->len) e->cursor_x++;
 }
 
 void move_cursor_backward_word(Editor *e) {
     if (e->cursor_x == 0 && e->cursor_y == 0) return;
-    while (e->cursor_x > 0 && ISSPACE(e->lines[e->cursor_y][e->cursor_x - 1])) {
+    char *text = buffer_line(e->buf, e->cursor_y)->text;
+    while (e->cursor_x > 0 && ISSPACE(text[e->cursor_x - 1])) {
         e->cursor_x--;
     }
-    while (e->cursor_x > 0 && !ISALNUM(e->lines[e->cursor_y][e->cursor_x - 1]) && !ISSPACE(e->lines[e->cursor_y][e->cursor_x - 1])) {
+    while (e->cursor_x > 0 && !ISALNUM(text[e->cursor_x - 1]) && !ISSPACE(text[e->cursor_x - 1])) {
         e->cursor_x--;
     }
-    while (e->cursor_x > 0 && ISALNUM(e->lines[e->cursor_y][e->cursor_x - 1])) {
+    while (e->cursor_x > 0 && ISALNUM(text[e->cursor_x - 1])) {
         e->cursor_x--;
     }
     if (e->cursor_x == 0 && e->cursor_y > 0) {
         e->cursor_y--;
-        e->cursor_x = STRLEN(e->lines[e->cursor_y]);
-        while (e->cursor_x > 0 && ISSPACE(e->lines[e->cursor_y][e->cursor_x - 1])) {
+        Line *line = buffer_line(e->buf, e->cursor_y);
+        text = line->text;
+        e->cursor_x = line->len;
+        while (e->cursor_x > 0 && ISSPACE(text[e->cursor_x - 1])) {
             e->cursor_x--;
         }
-        while (e->cursor_x > 0 && !ISALNUM(e->lines[e->cursor_y][e->cursor_x - 1]) && !ISSPACE(e->lines[e->cursor_y][e->cursor_x - 1])) {
+        while (e->cursor_x > 0 && !ISALNUM(text[e->cursor_x - 1]) && !ISSPACE(text[e->cursor_x - 1])) {
             e->cursor_x--;
         }
     }
-    draw(e);
 }
 
 void move_cursor_forward_word(Editor *e) {
-    char *line = e->lines[e->cursor_y];
-    while (line[e->cursor_x] && ISALNUM(line[e->cursor_x])) {
+    Line *line = buffer_line(e->buf, e->cursor_y);
+    while (e->cursor_x < line->len && ISALNUM(line->text[e->cursor_x])) {
         e->cursor_x++;
     }
-    while (line[e->cursor_x] && !ISALNUM(line[e->cursor_x]) && !ISSPACE(line[e->cursor_x])) {
+    while (e->cursor_x < line->len && !ISALNUM(line->text[e->cursor_x]) && !ISSPACE(line->text[e->cursor_x])) {
         e->cursor_x++;
     }
-    while (line[e->cursor_x] && ISSPACE(line[e->cursor_x])) {
+    while (e->cursor_x < line->len && ISSPACE(line->text[e->cursor_x])) {
         e->cursor_x++;
     }
-    if (!line[e->cursor_x] && e->cursor_y < e->num_lines - 1) {
+    if (e->cursor_x == line->len && buffer_has_line(e->buf, e->cursor_y + 1)) {
         e->cursor_y++;
         e->cursor_x = 0;
     }
-    draw(e);
 }
 
 void move_cursor_backward_paragraph(Editor *e) {
     while (e->cursor_y > 0) {
         e->cursor_y--;
-        if (STRLEN(e->lines[e->cursor_y]) == 0) {
+        if (buffer_line(e->buf, e->cursor_y)->len == 0) {
             e->cursor_x = 0;
             break;
         }
     }
     e->cursor_x = 0;
     if (e->cursor_y < e->top_line) e->top_line = e->cursor_y;
-    draw(e);
 }
 
 void move_cursor_forward_paragraph(Editor *e) {
-    while (e->cursor_y < e->num_lines - 1) {
+    while (buffer_has_line(e->buf, e->cursor_y + 1)) {
         e->cursor_y++;
-        if (STRLEN(e->lines[e->cursor_y]) == 0) {
+        if (buffer_line(e->buf, e->cursor_y)->len == 0) {
             e->cursor_x = 0;
             break;
         }
     }
     e->cursor_x = 0;
     if (e->cursor_y >= e->top_line + e->max_y - 1) e->top_line = e->cursor_y - e->max_y + 2;
-    draw(e);
 }
 
 void move_cursor_beginning_of_line(Editor *e) {
     e->cursor_x = 0;
-    draw(e);
 }
 
 void move_cursor_end_of_line(Editor *e) {
-    e->cursor_x = STRLEN(e->lines[e->cursor_y]);
-    draw(e);
+    e->cursor_x = buffer_line(e->buf, e->cursor_y)->len;
+}
+
+// The kill ring holds the last kill_ring_size kills; entry 0 is the newest.
+TextChunk *kill_ring_entry(Editor *e, int i) {
+    return e->kill_ring[(e->kill_head - i + e->kill_ring_size) % e->kill_ring_size];
+}
+
+void kill_ring_push(Editor *e, TextChunk *text) {
+    e->kill_head = (e->kill_head + 1) % e->kill_ring_size;
+    if (e->kill_count == e->kill_ring_size) chunk_unref(e->kill_ring[e->kill_head]);
+    else e->kill_count++;
+    e->kill_ring[e->kill_head] = text;
+}
+
+// Cuts the text between two positions to the kill ring. The kill ring and
+// the undo log share the one copy of it. A kill that starts or ends where
+// the previous kill left the cursor, with no edit in between, is added to
+// the same entry, so repeated Ctrl+K collects the lines it cuts. Killing
+// nothing, as Ctrl+K does on an empty last line, leaves the ring alone.
+void kill_range(Editor *e, int y1, int x1, int y2, int x2) {
+    TextChunk *text = buffer_copy_range(e->buf, y1, x1, y2, x2);
+    if (text->len == 0) {
+        chunk_unref(text);
+        return;
+    }
+    undo_record_chunk(e->buf, UNDO_DELETE, y1, x1, text, false);
+    bool follows = e->kill_count > 0 && e->kill_buf == e->buf && e->kill_version == e->buf->version;
+    if (follows && y1 == e->kill_y && x1 == e->kill_x) {
+        TextChunk *joined = chunk_concat(kill_ring_entry(e, 0), text);
+        chunk_unref(text);
+        chunk_unref(e->kill_ring[e->kill_head]);
+        e->kill_ring[e->kill_head] = joined;
+    } else if (follows && y2 == e->kill_y && x2 == e->kill_x) {
+        TextChunk *joined = chunk_concat(text, kill_ring_entry(e, 0));
+        chunk_unref(text);
+        chunk_unref(e->kill_ring[e->kill_head]);
+        e->kill_ring[e->kill_head] = joined;
+    } else {
+        kill_ring_push(e, text);
+    }
+    buffer_delete_range(e->buf, y1, x1, y2, x2);
+    e->kill_buf = e->buf;
+    e->kill_version = e->buf->version;
+    e->kill_y = y1;
+    e->kill_x = x1;
 }
 
+// Cuts to the end of the line, or the line break itself if the cursor is
+// already at the end.
 void kill_line(Editor *e) {
     if (e->mark_active) {
         delete_region(e);
         return;
     }
-    char *line = e->lines[e->cursor_y];
-    if (e->kill_ring[0]) free(e->kill_ring[0]);
-    e->kill_ring[0] = STRDUP(line + e->cursor_x);
-    line[e->cursor_x] = '\0';
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
+    Line *line = buffer_line(e->buf, e->cursor_y);
+    if (e->cursor_x == line->len && buffer_has_line(e->buf, e->cursor_y + 1)) {
+        kill_range(e, e->cursor_y, e->cursor_x, e->cursor_y + 1, 0);
+    } else {
+        kill_range(e, e->cursor_y, e->cursor_x, e->cursor_y, line->len);
+    }
     snprintf(e->message, sizeof(e->message), "Line cut to kill-ring");
-    draw(e);
+}
+
+// Inserts kill ring entry yank_index at the cursor and remembers where it
+// went, so that yank_pop can swap it for another entry.
+void yank_entry(Editor *e, bool chained) {
+    TextChunk *text = kill_ring_entry(e, e->yank_index);
+    e->yank_y = e->cursor_y;
+    e->yank_x = e->cursor_x;
+    undo_record_chunk(e->buf, UNDO_INSERT, e->cursor_y, e->cursor_x, text, chained);
+    buffer_insert_chunk(e->buf, &e->cursor_y, &e->cursor_x, text);
+    e->yank_end_y = e->cursor_y;
+    e->yank_end_x = e->cursor_x;
+    e->yank_buf = e->buf;
+    e->yank_version = e->buf->version;
 }
 
 void yank(Editor *e) {
-    if (!e->kill_ring[0]) {
+    if (e->kill_count == 0) {
         snprintf(e->message, sizeof(e->message), "Nothing to yank");
         return;
     }
-    char *text = e->kill_ring[0];
-    char **new_lines = malloc(MAX_LINES * sizeof(char *));
-    int line_count = 0;
-    char *start = text;
-    char *end;
-    while ((end = STRCHR(start, '\n')) && line_count < MAX_LINES) {
-        new_lines[line_count] = STRNDUP(start, end - start);
-        line_count++;
-        start = end + 1;
-    }
-    if (*start && line_count < MAX_LINES) {
-        new_lines[line_count] = STRDUP(start);
-        line_count++;
-    }
-    if (line_count == 0) {
-        new_lines[0] = STRDUP(text);
-        line_count = 1;
-    }
-    insert_lines(e, new_lines, line_count, true);
-    for (int i = 0; i < line_count; i++) free(new_lines[i]);
-    free(new_lines);
+    e->yank_index = 0;
+    yank_entry(e, false);
     snprintf(e->message, sizeof(e->message), "Yanked from kill-ring");
 }
 
+// Replaces the text just yanked with the next older kill ring entry. Undo
+// takes back the swap in one step.
+void yank_pop(Editor *e) {
+    if (e->yank_buf != e->buf || e->yank_version != e->buf->version ||
+        e->cursor_y != e->yank_end_y || e->cursor_x != e->yank_end_x) {
+        snprintf(e->message, sizeof(e->message), "Previous command was not a yank");
+        return;
+    }
+    TextChunk *text = kill_ring_entry(e, e->yank_index);
+    undo_record_chunk(e->buf, UNDO_DELETE, e->yank_y, e->yank_x, text, false);
+    buffer_delete_range(e->buf, e->yank_y, e->yank_x, e->cursor_y, e->cursor_x);
+    e->cursor_y = e->yank_y;
+    e->cursor_x = e->yank_x;
+    e->yank_index = (e->yank_index + 1) % e->kill_count;
+    yank_entry(e, true);
+    snprintf(e->message, sizeof(e->message), "Yanked kill-ring entry %d of %d", e->yank_index + 1, e->kill_count);
+}
+
 void set_mark(Editor *e) {
     e->mark_x = e->cursor_x;
     e->mark_y = e->cursor_y;
@@ -938,107 +4247,560 @@ void delete_region(Editor *e) {
         end_y = e->mark_y;
         end_x = e->mark_x;
     }
-    if (e->kill_ring[0]) free(e->kill_ring[0]);
-    e->kill_ring[0] = NULL;
-    if (start_y == end_y) {
-        char *line = e->lines[start_y];
-        int len = end_x - start_x;
-        e->kill_ring[0] = STRNDUP(line + start_x, len);
-        memmove(line + start_x, line + end_x, (STRLEN(line + end_x) + 1) * sizeof(char));
-        e->cursor_y = start_y;
-        e->cursor_x = start_x;
-    } else {
-        char *first = e->lines[start_y] + start_x;
-        size_t kill_len = STRLEN(first) + 1;
-        for (int y = start_y + 1; y < end_y; y++) {
-            kill_len += STRLEN(e->lines[y]) + 1;
-        }
-        char *last = STRNDUP(e->lines[end_y], end_x);
-        kill_len += STRLEN(last);
-        e->kill_ring[0] = malloc((kill_len + 1) * sizeof(char));
-        e->kill_ring[0][0] = '\0';
-        STRCAT(e->kill_ring[0], first);
-        STRCAT(e->kill_ring[0], NEWLINE);
-        for (int y = start_y + 1; y < end_y; y++) {
-            STRCAT(e->kill_ring[0], e->lines[y]);
-            STRCAT(e->kill_ring[0], NEWLINE);
-        }
-        STRCAT(e->kill_ring[0], last);
-        free(last);
-        char *new_line = malloc((STRLEN(e->lines[start_y]) - start_x + end_x + 1) * sizeof(char));
-        STRNCPY(new_line, e->lines[start_y], start_x);
-        new_line[start_x] = '\0';
-        STRCAT(new_line, e->lines[end_y] + end_x);
-        free(e->lines[start_y]);
-        e->lines[start_y] = new_line;
-        for (int y = start_y + 1; y <= end_y; y++) {
-            free(e->lines[y]);
-        }
-        memmove(&e->lines[start_y + 1], &e->lines[end_y + 1], (e->num_lines - end_y - 1) * sizeof(char *));
-        e->num_lines -= (end_y - start_y);
-        e->cursor_y = start_y;
-        e->cursor_x = start_x;
-    }
+    kill_range(e, start_y, start_x, end_y, end_x);
+    e->cursor_y = start_y;
+    e->cursor_x = start_x;
     e->mark_active = false;
-    e->num_lines_buf[e->current_buffer] = e->num_lines;
     snprintf(e->message, sizeof(e->message), "Region cut to kill-ring");
-    draw(e);
+}
+
+// Returns the offset of the next match on line at or after from, or at or
+// before it when searching backward, or -1. re is NULL for literal search.
+// The length of the match is stored in *match_len if it is not NULL.
+int search_line(Line *line, int from, const char *needle, int nlen, Regex *re, bool backward, int *match_len) {
+    if (re) return regex_find(re, line->text, line->len, from, backward, match_len);
+    if (match_len) *match_len = nlen;
+    if (backward) return find_backward(line->text, line->len, from, needle, nlen);
+    return find_forward(line->text, line->len, from, needle, nlen);
+}
+
+// Like search_line forward, for callers that walk every match on a line.
+// A regexp line must already have been through regex_scan, so that each
+// step only looks up the next start and measures that one match.
+// Regexp matches are measured no further than limit.
+int search_line_next(Line *line, int from, const char *needle, int nlen, Regex *re, int limit, int *match_len) {
+    if (!re) return search_line(line, from, needle, nlen, NULL, false, match_len);
+    const unsigned char *start = from < line->len ? memchr(re->starts + from, 1, line->len - from) : NULL;
+    if (!start) return -1;
+    int k = start - re->starts;
+    if (match_len) *match_len = regex_match_len(re, line->text, line->len, k, limit);
+    return k;
+}
+
+// Finds the next match at or after (*y, *x), or at or before it when
+// searching backward, wrapping around the ends of the buffer. Sets *wrapped
+// if the match was only found after wrapping.
+bool search_buffer(TextBuffer *b, const char *needle, int nlen, Regex *re, bool backward, int *y, int *x, bool *wrapped) {
+    for (int pass = 0; pass < 2; pass++) {
+        *wrapped = pass == 1;
+        if (!backward) {
+            for (int ly = pass ? 0 : *y; (!pass || ly <= *y) && buffer_has_line(b, ly); ly++) {
+                int k = search_line(buffer_line(b, ly), !pass && ly == *y ? *x : 0, needle, nlen, re, false, NULL);
+                if (k >= 0) {
+                    *y = ly;
+                    *x = k;
+                    return true;
+                }
+            }
+        } else {
+            int ly = pass ? buffer_num_lines(b) - 1 : *y;
+            for (; ly >= (pass ? *y : 0); ly--) {
+                int k = search_line(buffer_line(b, ly), !pass && ly == *y ? *x : INT_MAX, needle, nlen, re, true, NULL);
+                if (k >= 0) {
+                    *y = ly;
+                    *x = k;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Returns the matches of the current search on line y that start before
+// the right edge of the screen, scanning the line only if the cache holds
+// nothing current for it. Matches may overlap, the same way Ctrl+S steps
+// through them.
+MatchLine *search_matches(Editor *e, int y) {
+    MatchLine *m = &e->match_cache[y & (MATCH_CACHE_LINES - 1)];
+    int limit = e->left_col + e->max_x - e->gutter;
+    if (m->y == y && m->stamp == e->search_stamp && m->version == e->buf->version && m->limit >= limit) return m;
+    m->y = y;
+    m->limit = limit;
+    m->stamp = e->search_stamp;
+    m->version = e->buf->version;
+    m->count = 0;
+    Line *line = buffer_line(e->buf, y);
+    Regex *re = e->search_regex ? &e->regex : NULL;
+    int len;
+    if (re) regex_scan(re, line->text, line->len);
+    for (int k = 0; (k = search_line_next(line, k, e->search_query, e->search_len, re, limit, &len)) >= 0 && k < limit; k++) {
+        if (len <= 0) continue;
+        if (m->count == m->capacity) {
+            m->capacity = m->capacity ? m->capacity * 2 : 8;
+            m->matches = realloc(m->matches, m->capacity * sizeof(Span));
+        }
+        m->matches[m->count++] = (Span){ k, len, TOKEN_NORMAL };
+    }
+    return m;
+}
+
+// Formats the status line for the search in progress.
+void search_status(Editor *e) {
+    int len = e->search_len;
+    Regex *re = e->search_regex ? &e->regex : NULL;
+    char label[64], extra[64] = "";
+    snprintf(label, sizeof(label), "%s%s%s", e->search_failed[len] ? "failing " : e->search_wrapped ? "wrapped " : "",
+             e->search_backward ? "reverse " : "", re ? "regexp search" : "search");
+    label[0] = toupper(label[0]);
+    if (re && re->error && len > 0) {
+        snprintf(extra, sizeof(extra), " [%s]", re->error);
+    } else if (len > 0 && !e->search_failed[len]) {
+        if (e->count_done) snprintf(extra, sizeof(extra), " (%d of %d)", e->count_before + 1, e->count_total);
+        else snprintf(extra, sizeof(extra), " (%d so far)", e->count_total);
+    }
+    snprintf(e->message, sizeof(e->message), "%s: %.*s%s", label, len, e->search_query, extra);
+}
+
+// Restarts the match count, and if the query itself changed, drops the
+// cached matches and repaints them.
+void search_changed(Editor *e, bool query_changed) {
+    e->count_y = e->count_total = e->count_before = 0;
+    e->count_done = false;
+    if (query_changed) {
+        e->search_stamp++;
+        e->full_redraw = true;
+    }
+}
+
+// Counts the matches of the search in progress, a slice of about
+// SEARCH_COUNT_BYTES at a time. It runs from poll_background while input is
+// idle, so the "N of M" counter never holds up typing. Returns true while
+// there is more to scan.
+bool search_count_step(Editor *e) {
+    if (!e->searching || e->count_done) return false;
+    int len = e->search_len;
+    if (len == 0 || e->search_failed[len]) {
+        e->count_done = true;
+        return false;
+    }
+    TextBuffer *b = e->buf;
+    Regex *re = e->search_regex ? &e->regex : NULL;
+    int my = e->search_match_y[len], mx = e->search_match_x[len];
+    for (long scanned = 0; scanned < SEARCH_COUNT_BYTES && buffer_has_line(b, e->count_y); e->count_y++) {
+        Line *line = buffer_line(b, e->count_y);
+        if (re) regex_scan(re, line->text, line->len);
+        for (int k = 0; (k = search_line_next(line, k, e->search_query, len, re, line->len, NULL)) >= 0; k++) {
+            e->count_total++;
+            if (e->count_y < my || (e->count_y == my && k < mx)) e->count_before++;
+        }
+        scanned += line->len + 1;
+    }
+    e->count_done = !buffer_has_line(b, e->count_y);
+    search_status(e);
+    return !e->count_done;
 }
 
 void start_search(Editor *e) {
     e->searching = true;
-    e->search_query[0] = '\0';
-    snprintf(e->message, sizeof(e->message), "Search: ");
-    draw(e);
+    e->search_backward = false;
+    e->search_regex = false;
+    e->search_wrapped = false;
+    e->search_len = 0;
+    e->search_failed[0] = false;
+    e->search_match_x[0] = e->cursor_x;
+    e->search_match_y[0] = e->cursor_y;
+    search_changed(e, true);
+    search_status(e);
+}
+
+void start_reverse_search(Editor *e) {
+    start_search(e);
+    e->search_backward = true;
+    search_status(e);
 }
 
+void start_regex_search(Editor *e) {
+    start_search(e);
+    e->search_regex = true;
+    search_status(e);
+}
+
+// Incremental search. search_match_x/y[n] hold the match for the first n
+// characters of the query, so Backspace just steps back to the previous
+// one. A literal query can only match where its prefix did, so typing a
+// character resumes from the current match, and once a prefix fails nothing
+// is scanned until the query is shortened again. A regexp is recompiled and
+// searched from where the search started. Ctrl+S and Ctrl+R move to the
+// next and previous match.
 void update_search(Editor *e, int c) {
     if (!e->searching) return;
-    int len = strlen(e->search_query);
+    int len = e->search_len;
+    Regex *re = e->search_regex ? &e->regex : NULL;
+    e->search_wrapped = false;
     if (c == 27 || c == '\n') {
         e->searching = false;
-        e->search_query[0] = '\0';
+        e->search_query[len] = '\0';
+        e->full_redraw = true;
         snprintf(e->message, sizeof(e->message), "Search ended");
-        draw(e);
         return;
     }
-    if (c == 127 || c == KEY_BACKSPACE) {
-        if (len > 0) e->search_query[len - 1] = '\0';
-    } else if (isprint(c) && len < sizeof(e->search_query) - 1) {
+    if (c == CTRL_KEY('s') || c == CTRL_KEY('r')) {
+        e->search_backward = c == CTRL_KEY('r');
+        if (len == 0) {
+            // Ctrl+S on an empty query repeats the previous search.
+            len = e->search_len = STRLEN(e->search_query);
+            for (int n = 1; n <= len; n++) {
+                e->search_match_x[n] = e->search_match_x[0];
+                e->search_match_y[n] = e->search_match_y[0];
+                e->search_failed[n] = false;
+            }
+            if (re && len > 0 && !regex_compile(re, e->search_query, len)) e->search_failed[len] = true;
+            search_changed(e, true);
+        }
+        int y = e->search_match_y[len];
+        int x = e->search_match_x[len] + (e->search_backward ? -1 : 1);
+        if (len > 0 && (!re || re->root >= 0)) {
+            e->search_failed[len] = !search_buffer(e->buf, e->search_query, len, re, e->search_backward, &y, &x, &e->search_wrapped);
+            if (!e->search_failed[len]) {
+                e->search_match_x[len] = x;
+                e->search_match_y[len] = y;
+                // A finished count can follow the step; a partial one restarts.
+                if (!e->count_done) search_changed(e, false);
+                else if (e->search_backward) e->count_before = e->search_wrapped ? e->count_total - 1 : e->count_before - 1;
+                else e->count_before = e->search_wrapped ? 0 : e->count_before + 1;
+            }
+        }
+    } else if (c == 127 || c == KEY_BACKSPACE) {
+        if (len > 0) e->search_len = --len;
+        if (re && len > 0) regex_compile(re, e->search_query, len);
+        search_changed(e, true);
+    } else if (isprint(c) && len < (int)sizeof(e->search_query) - 1) {
         e->search_query[len] = (char)c;
         e->search_query[len + 1] = '\0';
+        e->search_len = ++len;
+        int y = e->search_match_y[re ? 0 : len - 1];
+        int x = e->search_match_x[re ? 0 : len - 1];
+        if (re) e->search_failed[len] = !regex_compile(re, e->search_query, len);
+        else e->search_failed[len] = e->search_failed[len - 1];
+        if (!e->search_failed[len]) {
+            e->search_failed[len] = !search_buffer(e->buf, e->search_query, len, re, e->search_backward, &y, &x, &e->search_wrapped);
+        }
+        e->search_match_x[len] = e->search_failed[len] ? e->search_match_x[len - 1] : x;
+        e->search_match_y[len] = e->search_failed[len] ? e->search_match_y[len - 1] : y;
+        search_changed(e, true);
+    }
+    e->cursor_x = e->search_match_x[len];
+    e->cursor_y = e->search_match_y[len];
+    search_status(e);
+}
+
+// Cycles to the next buffer.
+void switch_buffer(Editor *e) {
+    if (e->num_buffers == 1) {
+        snprintf(e->message, sizeof(e->message), "No other buffer");
+        return;
+    }
+    show_buffer(e, (e->current_buffer + 1) % e->num_buffers);
+}
+
+// Opens a file in a buffer of its own, or shows the buffer already
+// visiting it.
+void find_file(Editor *e) {
+    char filename[MAX_FILENAME_LEN];
+    read_prompt(e, "Find file: ", filename, MAX_FILENAME_LEN);
+    if (!filename[0]) return;
+    show_buffer(e, add_buffer(e, filename));
+}
+
+// Shows a buffer chosen by number or by file name. A name without a
+// directory also matches the last part of a buffer's path.
+void select_buffer(Editor *e) {
+    char prompt[64], input[MAX_FILENAME_LEN];
+    snprintf(prompt, sizeof(prompt), "Switch to buffer (1-%d or name): ", e->num_buffers);
+    read_prompt(e, prompt, input, sizeof(input));
+    if (!input[0]) return;
+    char *end;
+    long n = strtol(input, &end, 10);
+    if (*end == '\0' && n >= 1 && n <= e->num_buffers) {
+        show_buffer(e, n - 1);
+        return;
+    }
+    for (int i = 0; i < e->num_buffers; i++) {
+        const char *name = e->buffers[i]->filename;
+        if (!name) continue;
+        const char *base = strrchr(name, '/');
+        if (strcmp(name, input) == 0 || (base && strcmp(base + 1, input) == 0)) {
+            show_buffer(e, i);
+            return;
+        }
+    }
+    snprintf(e->message, sizeof(e->message), "No buffer %.200s", input);
+}
+
+void goto_line(Editor *e) {
+    char input[32];
+    read_prompt(e, "Goto line: ", input, sizeof(input));
+    int y = atoi(input) - 1;
+    if (y < 0) {
+        snprintf(e->message, sizeof(e->message), "Invalid line number");
+        return;
+    }
+    if (!buffer_has_line(e->buf, y)) y = buffer_num_lines(e->buf) - 1;
+    e->cursor_y = y;
+    e->cursor_x = 0;
+    e->top_line = y - (e->max_y - 1) / 2;
+    snprintf(e->message, sizeof(e->message), "Line %d", y + 1);
+}
+
+// Runs background work that finished while waiting for input.
+typedef struct {
+    char *data;
+    size_t len, cap;
+} ByteBuffer;
+
+void bytes_append(ByteBuffer *bb, const char *s, size_t n) {
+    if (bb->len + n + 1 > bb->cap) {
+        bb->cap = (bb->len + n + 1) * 2;
+        bb->data = realloc(bb->data, bb->cap);
+    }
+    memcpy(bb->data + bb->len, s, n);
+    bb->len += n;
+    bb->data[bb->len] = '\0';
+}
+
+// Replaces up to limit matches of needle with repl, starting at column x of
+// line y and running to the end of the buffer. Each affected line is
+// rebuilt once, and the whole pass is undone as one step.
+// Returns the number of replacements made.
+int replace_matches(Editor *e, int y, int x, const char *needle, int nlen, const char *repl, int rlen, int limit) {
+    TextBuffer *b = e->buf;
+    ByteBuffer line = {0};
+    int count = 0, lines = 0;
+    for (; count < limit && buffer_has_line(b, y); y++, x = 0) {
+        Line *l = buffer_line(b, y);
+        int k = find_forward(l->text, l->len, x, needle, nlen);
+        if (k < 0) continue;
+        line.len = 0;
+        int done = 0;
+        for (; k >= 0 && count < limit; k = find_forward(l->text, l->len, done, needle, nlen)) {
+            bytes_append(&line, l->text + done, k - done);
+            bytes_append(&line, repl, rlen);
+            done = k + nlen;
+            count++;
+        }
+        bytes_append(&line, l->text + done, l->len - done);
+
+        undo_record(b, UNDO_DELETE, y, 0, l->text, l->len, lines++ > 0);
+        undo_record(b, UNDO_INSERT, y, 0, line.data, line.len, true);
+        buffer_set_line(b, y, line.data, line.len);
     }
-    char buffer[MAX_LINE_LEN];
-    for (int y = e->cursor_y; y < e->num_lines; y++) {
-        snprintf(buffer, MAX_LINE_LEN, "%s", e->lines[y]);
-        char *match = strstr(buffer + (y == e->cursor_y ? e->cursor_x : 0), e->search_query);
-        if (match) {
-            e->cursor_y = y;
-            e->cursor_x = match - buffer;
-            if (e->cursor_y >= e->top_line + e->max_y - 1) e->top_line = e->cursor_y - e->max_y + 2;
+    free(line.data);
+    return count;
+}
+
+void replace_all(Editor *e) {
+    char from[256], to[256];
+    read_prompt(e, "Replace all: ", from, sizeof(from));
+    if (!from[0]) return;
+    read_prompt(e, "Replace all with: ", to, sizeof(to));
+    int count = replace_matches(e, 0, 0, from, STRLEN(from), to, STRLEN(to), INT_MAX);
+    Line *line = buffer_line(e->buf, e->cursor_y);
+    if (e->cursor_x > line->len) e->cursor_x = line->len;
+    snprintf(e->message, sizeof(e->message), "Replaced %d occurrence%s", count, count == 1 ? "" : "s");
+}
+
+// Steps through the matches after the cursor, asking at each one: y or
+// Space replaces it, n or Backspace skips it, ! replaces it and all the
+// rest in one pass, and q, Enter or Esc stops.
+void query_replace(Editor *e) {
+    char from[256], to[256];
+    read_prompt(e, "Query replace: ", from, sizeof(from));
+    if (!from[0]) return;
+    read_prompt(e, "Query replace with: ", to, sizeof(to));
+    int nlen = STRLEN(from), rlen = STRLEN(to);
+    int count = 0;
+    int y = e->cursor_y, x = e->cursor_x;
+    while (buffer_has_line(e->buf, y)) {
+        Line *line = buffer_line(e->buf, y);
+        int k = find_forward(line->text, line->len, x, from, nlen);
+        if (k < 0) {
+            y++;
+            x = 0;
+            continue;
+        }
+        e->cursor_y = y;
+        e->cursor_x = k;
+        snprintf(e->message, sizeof(e->message), "Replace \"%.100s\" with \"%.100s\"? (y, n, ! or q)", from, to);
+        draw(e);
+        timeout(-1);
+        int ch = getch();
+        if (ch == 'y' || ch == ' ') {
+            count += replace_matches(e, y, k, from, nlen, to, rlen, 1);
+            x = k + rlen;
+        } else if (ch == 'n' || ch == 127 || ch == KEY_BACKSPACE) {
+            x = k + nlen;
+        } else if (ch == '!') {
+            count += replace_matches(e, y, k, from, nlen, to, rlen, INT_MAX);
+            break;
+        } else if (ch == 'q' || ch == 27 || ch == '\n') {
             break;
         }
     }
-    snprintf(e->message, sizeof(e->message), "Search: %s", e->search_query);
-    draw(e);
+    snprintf(e->message, sizeof(e->message), "Replaced %d occurrence%s", count, count == 1 ? "" : "s");
 }
 
-void switch_buffer(Editor *e) {
-    e->current_buffer = 1 - e->current_buffer;
-    e->lines = e->buffers[e->current_buffer];
-    e->num_lines = e->num_lines_buf[e->current_buffer];
-    e->filename = e->filenames[e->current_buffer];
-    e->cursor_x = e->cursor_y = e->top_line = 0;
-    detect_language(e);
-    snprintf(e->message, sizeof(e->message), "Switched to buffer %d", e->current_buffer + 1);
+// Adds one byte of a paste to text, dropping control characters other than
+// line breaks and tabs. Terminals send line breaks as carriage returns.
+void paste_byte(ByteBuffer *text, int ch) {
+    char c = ch == '\r' ? '\n' : (char)ch;
+    if (ch < 256 && (c == '\n' || c == '\t' || !iscntrl((unsigned char)c))) bytes_append(text, &c, 1);
+}
+
+// Reads the rest of a bracketed paste, up to the closing ESC [ 201 ~, and
+// inserts it as one edit with one undo record. Over a slow link or through
+// tmux a paste can stall between bytes, and whatever came after an early
+// end would run as keystrokes, so only a stall of PASTE_GAP_TIMEOUT gives
+// up on the marker. Bytes that began to look like the marker but were not
+// go through the same filter as the rest.
+void paste(Editor *e) {
+    static const char end[] = "\033[201~";
+    ByteBuffer text = {0};
+    int matched = 0;
+    timeout(PASTE_GAP_TIMEOUT);
+    while (end[matched]) {
+        int ch = getch();
+        if (ch == ERR) break;
+        if (ch == end[matched]) {
+            matched++;
+            continue;
+        }
+        for (int k = 0; k < matched; k++) paste_byte(&text, end[k]);
+        matched = ch == end[0];
+        if (!matched) paste_byte(&text, ch);
+    }
+    if (text.len == 0) return;
+    TextChunk *chunk = chunk_from_text(text.data, text.len);
+    undo_record_chunk(e->buf, UNDO_INSERT, e->cursor_y, e->cursor_x, chunk, false);
+    buffer_insert_chunk(e->buf, &e->cursor_y, &e->cursor_x, chunk);
+    snprintf(e->message, sizeof(e->message), "Pasted %d line%s", chunk->line_count, chunk->line_count == 1 ? "" : "s");
+    chunk_unref(chunk);
+    free(text.data);
+}
+
+// Handles a control sequence that the terminal sent after ESC [ and that
+// keypad() did not already turn into a key code.
+void read_csi(Editor *e) {
+    int param = 0, ch;
+    timeout(PASTE_TIMEOUT);
+    while ((ch = getch()) != ERR && isdigit(ch)) param = param * 10 + ch - '0';
+    if (ch == '~' && param == 200) paste(e);
+    else snprintf(e->message, sizeof(e->message), "Unknown escape sequence: ESC [ %d %c", param, ch == ERR ? ' ' : ch);
+}
+
+// Handles one key, timing the command when instrumentation is on.
+void run_key(Editor *e, int ch) {
+    Stats *s = &e->stats;
+    if (!s->enabled) {
+        handle_input(e, ch);
+        return;
+    }
+    if (s->frame_keys++ == 0) {
+        s->frame_ns = 0;
+        s->frame_allocs = alloc_count;
+    }
+    long start = now_ns();
+    handle_input(e, ch);
+    long ns = now_ns() - start;
+    hist_record(&s->hist[STAT_COMMAND], ns);
+    s->last[STAT_COMMAND] = ns;
+    s->frame_ns += ns;
+}
+
+// Draws the screen, and when instrumentation is on and keys were handled
+// since the last frame, records what the frame cost.
+void draw_frame(Editor *e) {
+    Stats *s = &e->stats;
+    if (!s->enabled || s->frame_keys == 0) {
+        draw(e);
+        return;
+    }
+    s->highlight_ns = 0;
+    long start = now_ns();
     draw(e);
+    long ns = now_ns() - start;
+    long costs[STAT_COUNT] = {
+        [STAT_COMMAND] = s->last[STAT_COMMAND],
+        [STAT_HIGHLIGHT] = s->highlight_ns,
+        [STAT_DRAW] = ns - s->highlight_ns,
+        [STAT_FRAME] = s->frame_ns + ns,
+        [STAT_ALLOCS] = alloc_count - s->frame_allocs,
+    };
+    for (int k = STAT_HIGHLIGHT; k < STAT_COUNT; k++) hist_record(&s->hist[k], costs[k]);
+    memcpy(s->last, costs, sizeof(costs));
+    s->frame_keys = 0;
+    if (s->overlay) {
+        const Histogram *f = &s->hist[STAT_FRAME];
+        char allocs[32] = "";
+#ifdef COUNT_ALLOCS
+        snprintf(allocs, sizeof(allocs), ", %ld allocs", costs[STAT_ALLOCS]);
+#endif
+        snprintf(s->overlay_text, sizeof(s->overlay_text),
+                 "frame p50 %.2f ms, p99 %.2f ms | last %.2f ms: command %.2f, highlight %.2f, draw %.2f%s",
+                 hist_percentile(f, 0.5) / 1e6, hist_percentile(f, 0.99) / 1e6, costs[STAT_FRAME] / 1e6,
+                 s->frame_ns / 1e6, costs[STAT_HIGHLIGHT] / 1e6, costs[STAT_DRAW] / 1e6, allocs);
+    }
+}
+
+void toggle_stats_overlay(Editor *e) {
+    Stats *s = &e->stats;
+    s->overlay = !s->overlay;
+    s->enabled = s->overlay || s->dump_path;
+    s->frame_keys = 0;
+    s->overlay_text[0] = '\0';
+    snprintf(e->message, sizeof(e->message), "Latency overlay %s", s->overlay ? "on" : "off");
+}
+
+// Writes a summary of every histogram, then its non-empty buckets, to the
+// file given with --stats.
+void stats_dump(Editor *e) {
+    Stats *s = &e->stats;
+    FILE *f = s->dump_path ? fopen(s->dump_path, "w") : NULL;
+    if (!f) return;
+    static const char *names[STAT_COUNT] = { "command", "highlight", "draw", "frame", "allocs" };
+    fprintf(f, "# times in microseconds, allocs per frame\n");
+    fprintf(f, "%-10s %8s %10s %10s %10s %10s %10s %10s\n", "stat", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int k = 0; k < STAT_COUNT; k++) {
+        const Histogram *h = &s->hist[k];
+        double unit = k == STAT_ALLOCS ? 1 : 1000;
+        fprintf(f, "%-10s %8ld %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[k], h->total,
+                h->total ? h->sum / unit / h->total : 0, hist_percentile(h, 0.5) / unit, hist_percentile(h, 0.9) / unit,
+                hist_percentile(h, 0.99) / unit, hist_percentile(h, 0.999) / unit, h->max / unit);
+    }
+    for (int k = 0; k < STAT_COUNT; k++) {
+        fprintf(f, "\n# %s: bucket upper bound%s, count\n", names[k], k == STAT_ALLOCS ? "" : " in ns");
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            if (s->hist[k].counts[i]) fprintf(f, "%ld %ld\n", hist_value(i), s->hist[k].counts[i]);
+        }
+    }
+    fclose(f);
+}
+
+void poll_background(Editor *e) {
+    for (int i = 0; i < e->num_buffers && e->saving; i++) {
+        TextBuffer *b = e->buffers[i];
+        if (!b->save) continue;
+        if (save_job_done(b->save)) save_finish(e, b);
+        else if (b == e->buf && !b->save->checkpoint) snprintf(e->message, sizeof(e->message), "Saving %s... %d%%", b->filename, (int)(save_job_progress(b->save) * 100));
+    }
+    if (e->buf->index_job && index_job_done(e->buf->index_job)) {
+        buffer_merge_index(e->buf);
+        snprintf(e->message, sizeof(e->message), "Indexed %s: %d lines", e->buf->filename, buffer_loaded_lines(e->buf));
+    }
+    follow_poll(e);
+    search_count_step(e);
+}
+
+void resize_screen(Editor *e) {
+    getmaxyx(stdscr, e->max_y, e->max_x);
+    e->dirty_rows = realloc(e->dirty_rows, e->max_y * sizeof(bool));
+    setscrreg(0, e->max_y > 1 ? e->max_y - 2 : 0);
+    e->full_redraw = true;
 }
 
 void show_info(Editor *e) {
     snprintf(e->message, sizeof(e->message), "Micrn Editor, Version 1.0, Created by Genius, 2025");
-    draw(e);
 }
-
 void handle_input(Editor *e, int ch) {
     static bool expecting_alt = false;
     static time_t ctrl_x_time = 0;
@@ -1065,9 +4827,22 @@ void handle_input(Editor *e, int ch) {
             delete_word_left(e);
         } else if (ch == KEY_DC) {
             delete_word_right(e);
+        } else if (ch == 'g') {
+            goto_line(e);
+        } else if (ch == 's') {
+            start_regex_search(e);
+        } else if (ch == '%') {
+            query_replace(e);
+        } else if (ch == 'r') {
+            replace_all(e);
+        } else if (ch == 'u') {
+            redo(e);
+        } else if (ch == 'y') {
+            yank_pop(e);
+        } else if (ch == '[') {
+            read_csi(e);
         } else {
             snprintf(e->message, sizeof(e->message), "Unknown Alt sequence: %d", ch);
-            draw(e);
         }
         return;
     }
@@ -1076,20 +4851,30 @@ void handle_input(Editor *e, int ch) {
         if (time(NULL) - ctrl_x_time > CTRL_X_TIMEOUT) {
             expecting_ctrl_x = false;
             snprintf(e->message, sizeof(e->message), "Ctrl+X timeout");
-            draw(e);
         } else if (ch == CTRL_KEY('s')) {
             save_file(e);
             expecting_ctrl_x = false;
         } else if (ch == CTRL_KEY('c')) {
-            cleanup_editor(e);
-            exit(0);
+            e->quit = true;
+            expecting_ctrl_x = false;
         } else if (ch == CTRL_KEY('x')) {
             switch_buffer(e);
             expecting_ctrl_x = false;
+        } else if (ch == CTRL_KEY('f')) {
+            find_file(e);
+            expecting_ctrl_x = false;
+        } else if (ch == 'b') {
+            select_buffer(e);
+            expecting_ctrl_x = false;
+        } else if (ch == 'l') {
+            toggle_stats_overlay(e);
+            expecting_ctrl_x = false;
+        } else if (ch == 't') {
+            toggle_follow(e);
+            expecting_ctrl_x = false;
         } else {
             snprintf(e->message, sizeof(e->message), "Unknown Ctrl+X sequence: %d", ch);
             expecting_ctrl_x = false;
-            draw(e);
         }
         return;
     }
@@ -1111,9 +4896,9 @@ void handle_input(Editor *e, int ch) {
     }
 
     if (ISPRINT(ch)) {
-        insert_char(e, ch, true);
+        insert_char(e, ch);
     } else if (ch == '\n' || ch == CTRL_KEY('j')) {
-        insert_newline(e, true);
+        insert_newline(e);
     } else if (ch == KEY_BACKSPACE || ch == 127) {
         delete_char(e);
     } else if (ch == KEY_DC) {
@@ -1128,14 +4913,156 @@ void handle_input(Editor *e, int ch) {
         move_cursor_right(e);
     } else if (ch == CTRL_KEY('d')) {
         delete_char(e);
+    } else if (ch == KEY_RESIZE) {
+        resize_screen(e);
     } else if (ch != ERR) {
         snprintf(e->message, sizeof(e->message), "Unknown key: %d", ch);
+    }
+}
+
+// Headless benchmark. micrn --bench trace.keys [file] opens file, then
+// feeds the raw terminal input recorded in trace.keys through the editor one
+// key at a time, drawing after each one as if it had been typed. Every key
+// is timed, and the samples are grouped by the kind of operation.
+typedef enum {
+    BENCH_OPEN,
+    BENCH_INSERT,
+    BENCH_NEWLINE,
+    BENCH_DELETE,
+    BENCH_MOVE,
+    BENCH_SEARCH,
+    BENCH_COMMAND,
+    BENCH_KINDS
+} BenchKind;
+
+typedef struct {
+    double *samples;     // microseconds
+    int count, capacity;
+    long allocs, bytes_out;
+} BenchOp;
+
+const char *bench_names[BENCH_KINDS] = { "open", "insert", "newline", "delete", "move", "search", "command" };
+
+BenchKind bench_kind(Editor *e, int ch, int prev) {
+    if (e->searching) return BENCH_SEARCH;
+    if (prev == 27 || prev == CTRL_KEY('x')) return BENCH_COMMAND;
+    if (ISPRINT(ch)) return BENCH_INSERT;
+    if (ch == '\n') return BENCH_NEWLINE;
+    if (ch == 127 || ch == KEY_BACKSPACE || ch == KEY_DC) return BENCH_DELETE;
+    if (ch == KEY_UP || ch == KEY_DOWN || ch == KEY_LEFT || ch == KEY_RIGHT || ch == CTRL_KEY('p') ||
+        ch == CTRL_KEY('n') || ch == CTRL_KEY('b') || ch == CTRL_KEY('f') || ch == CTRL_KEY('a') || ch == CTRL_KEY('e')) {
+        return BENCH_MOVE;
+    }
+    return BENCH_COMMAND;
+}
+
+void bench_sample(BenchOp *op, double us, long allocs, long bytes_out) {
+    if (op->count == op->capacity) {
+        op->capacity = op->capacity ? op->capacity * 2 : 256;
+        op->samples = realloc(op->samples, op->capacity * sizeof(double));
+    }
+    op->samples[op->count++] = us;
+    op->allocs += allocs;
+    op->bytes_out += bytes_out;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void bench_report(BenchOp *ops, const char *trace, const char *filename) {
+    printf("trace %s, file %s, %dx%d screen\n", trace, filename ? filename : "(none)", BENCH_COLS, BENCH_LINES);
+    printf("%-10s %8s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "p50 us", "p90 us", "p99 us", "max us", "allocs/op", "bytes/op");
+    int keys = 0;
+    double total = 0;
+    long allocs = 0, bytes_out = 0;
+    for (int k = 0; k < BENCH_KINDS; k++) {
+        BenchOp *op = &ops[k];
+        if (op->count == 0) continue;
+        qsort(op->samples, op->count, sizeof(double), compare_doubles);
+        for (int i = 0; i < op->count; i++) total += op->samples[i];
+        printf("%-10s %8d %10.1f %10.1f %10.1f %10.1f", bench_names[k], op->count, op->samples[op->count / 2],
+               op->samples[(int)(op->count * 0.9)], op->samples[(int)(op->count * 0.99)], op->samples[op->count - 1]);
+#ifdef COUNT_ALLOCS
+        printf(" %10.1f", (double)op->allocs / op->count);
+#else
+        printf(" %10s", "-");
+#endif
+        printf(" %10.1f\n", (double)op->bytes_out / op->count);
+        if (k != BENCH_OPEN) keys += op->count;
+        allocs += op->allocs;
+        bytes_out += op->bytes_out;
+        free(op->samples);
+    }
+    printf("%d keys in %.1f ms, ", keys, total / 1000);
+#ifdef COUNT_ALLOCS
+    printf("%ld allocations (%.1f MB), ", allocs, alloc_bytes / 1048576.0);
+#else
+    printf("allocations not counted in this build, ");
+#endif
+    printf("%ld bytes written to the terminal\n", bytes_out);
+}
+
+int run_bench(Editor *e, const char *trace, const char *filename) {
+    BenchOp ops[BENCH_KINDS] = {{0}};
+    double start = now_ns() / 1e3;
+    long allocs = alloc_count, bytes_out = term_bytes_written();
+    show_buffer(e, add_buffer(e, filename));
+    draw(e);
+    bench_sample(&ops[BENCH_OPEN], now_ns() / 1e3 - start, alloc_count - allocs, term_bytes_written() - bytes_out);
+
+    int ch, prev = 0;
+    for (timeout(-1); !e->quit && (ch = getch()) != ERR; prev = ch, timeout(-1)) {
+        BenchKind kind = bench_kind(e, ch, prev);
+        start = now_ns() / 1e3;
+        allocs = alloc_count;
+        bytes_out = term_bytes_written();
+        handle_input(e, ch);
         draw(e);
+        bench_sample(&ops[kind], now_ns() / 1e3 - start, alloc_count - allocs, term_bytes_written() - bytes_out);
     }
+    cleanup_editor(e);
+    bench_report(ops, trace, filename);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
+#ifdef COUNT_ALLOCS
+    alloc_counting = true;
+#endif
     Editor e = {0};
+    e.pack_idle = PACK_IDLE_SWITCHES;
+    e.kill_ring_size = KILL_RING_SIZE;
+    bool bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+    if (bench) {
+        if (argc < 3) {
+            fprintf(stderr, "usage: %s --bench trace.keys [file]\n", argv[0]);
+            return 1;
+        }
+        term.in = fopen(argv[2], "rb");
+        if (!term.in) {
+            perror(argv[2]);
+            return 1;
+        }
+        term.out = tmpfile();
+        term.headless = true;
+    }
+    int arg = 1;
+    for (; arg + 1 < argc; arg += 2) {
+        if (strcmp(argv[arg], "--stats") == 0) {
+            e.stats.dump_path = argv[arg + 1];
+            e.stats.enabled = true;
+        } else if (strcmp(argv[arg], "--memory") == 0) {
+            e.memory_budget = (size_t)atol(argv[arg + 1]) << 20;
+        } else if (strcmp(argv[arg], "--pack-idle") == 0) {
+            e.pack_idle = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "--kill-ring") == 0) {
+            e.kill_ring_size = atoi(argv[arg + 1]);
+        } else {
+            break;
+        }
+    }
     init_editor(&e);
     commands[CTRL_KEY('u')] = undo;
     commands[CTRL_KEY('k')] = kill_line;
@@ -1143,15 +5070,31 @@ int main(int argc, char *argv[]) {
     commands[0] = set_mark;
     commands[CTRL_KEY('w')] = delete_region;
     commands[CTRL_KEY('s')] = start_search;
+    commands[CTRL_KEY('r')] = start_reverse_search;
     commands[CTRL_KEY('a')] = move_cursor_beginning_of_line;
     commands[CTRL_KEY('e')] = move_cursor_end_of_line;
     commands[CTRL_KEY('i')] = show_info; 
-    if (argc > 1) load_file(&e, argv[1]);
+    if (bench) return run_bench(&e, argv[2], argc > 3 ? argv[3] : NULL);
+    // Files are only read when they are first shown.
+    for (; arg < argc; arg++) add_buffer(&e, argv[arg]);
+    if (e.num_buffers == 0) add_buffer(&e, NULL);
+    show_buffer(&e, 0);
 
-    while (1) {
-        draw(&e);
+    while (!e.quit) {
+        draw_frame(&e);
+        // Poll instead of blocking while there is background work to do.
+        timeout(e.searching && !e.count_done ? 0 : e.buf->index_job || e.saving ? 50 : e.buf->following ? FOLLOW_POLL_MS : -1);
         int ch = getch();
-        handle_input(&e, ch);
+        if (ch == ERR) poll_background(&e);
+        // Handle all input that is already waiting before drawing again, so
+        // a burst of keys costs one repaint.
+        for (int n = 0; ch != ERR && !e.quit && n < INPUT_BATCH_MAX; n++) {
+            run_key(&e, ch);
+            timeout(0);
+            ch = getch();
+        }
+        if (ch != ERR) ungetch(ch);
+        checkpoint_journals(&e);
     }
 
     cleanup_editor(&e);